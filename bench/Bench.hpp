@@ -0,0 +1,179 @@
+#ifndef __DYNBAR_BENCH_HPP__
+#define __DYNBAR_BENCH_HPP__
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+// Everything the benchmarks share: pinning, timing, percentiles and the CSV that Speed.py plots.
+namespace BENCH
+{
+    using Clock = std::chrono::steady_clock;
+
+    inline uint64_t Nanoseconds(Clock::duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    }
+
+    // Pins the calling thread to the tid-th CPU it is allowed to run on, so the scheduler does not move threads around
+    // in the middle of a measurement. If there are more threads than CPUs nobody is pinned, since stacking spinning
+    // threads on one CPU would only measure the scheduler.
+    inline void Pin(uint32_t tid, uint32_t threads)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || threads > uint32_t(CPU_COUNT(&allowed)))
+        {
+            return;
+        }
+        uint32_t skip = tid;
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed) && skip-- == 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                return;
+            }
+        }
+    }
+
+    // What a run measured: how long the timed episodes took altogether, and how long every one of them took.
+    struct Result
+    {
+        uint64_t nanoseconds = 0;
+        std::vector<uint64_t> samples;
+    };
+
+    // Runs threads pinned threads that call episode(tid, i) warmup times, and then iterations more times while thread 0
+    // times every one of them. An episode must end with a barrier, so once thread 0 is out of episode i, everyone is
+    // done with it, and the time between two of its exits is how long a whole episode took. Threads are created and
+    // warmed up before the clock starts.
+    template <typename Episode>
+    Result Run(uint32_t threads, uint32_t warmup, uint32_t iterations, Episode episode)
+    {
+        Result result;
+        result.samples.resize(iterations);
+        std::vector<std::thread> workers;
+        for (uint32_t tid = 0; tid < threads; tid++)
+        {
+            workers.emplace_back([&, tid]()
+            {
+                Pin(tid, threads);
+                for (uint32_t i = 0; i < warmup; i++)
+                {
+                    episode(tid, i);
+                }
+                if (tid != 0)
+                {
+                    for (uint32_t i = warmup; i < warmup + iterations; i++)
+                    {
+                        episode(tid, i);
+                    }
+                    return;
+                }
+                Clock::time_point start = Clock::now();
+                Clock::time_point last = start;
+                for (uint32_t i = 0; i < iterations; i++)
+                {
+                    episode(tid, warmup + i);
+                    Clock::time_point now = Clock::now();
+                    result.samples[i] = Nanoseconds(now - last);
+                    last = now;
+                }
+                result.nanoseconds = Nanoseconds(last - start);
+            });
+        }
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+        return result;
+    }
+
+    // The q-th quantile of the samples (which it sorts), e.g. 0.99 for p99
+    inline uint64_t Percentile(std::vector<uint64_t>& samples, double q)
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        size_t index = std::min(samples.size() - 1, size_t(q * samples.size()));
+        return samples[index];
+    }
+
+    // Writes results in the format Speed.py reads (and adds a few columns it ignores). Rows go to path, which gets a
+    // header if it is new, or to stdout if there is no path.
+    class CSV
+    {
+        private:
+            FILE* file;
+
+        public:
+            // Benchmarks that measure more than a phase can name their own columns, which go after the usual ones.
+            explicit CSV(const char* path, const std::vector<std::string>& extra_columns = {})
+            {
+                struct stat info;
+                bool existed = path != nullptr && stat(path, &info) == 0 && info.st_size != 0;
+                this->file = path == nullptr ? stdout : fopen(path, "a");
+                if (this->file == nullptr)
+                {
+                    this->file = stdout;
+                    existed = false;
+                }
+                if (!existed)
+                {
+                    fprintf(this->file, "Program,Threads,Iterations,Execution Time (seconds),"
+                                        "Throughput (episodes/second),p50 (ns),p99 (ns),p99.9 (ns)");
+                    for (const std::string& column : extra_columns)
+                    {
+                        fprintf(this->file, ",%s", column.c_str());
+                    }
+                    fprintf(this->file, "\n");
+                }
+            }
+
+            ~CSV()
+            {
+                if (this->file != stdout)
+                {
+                    fclose(this->file);
+                }
+                else
+                {
+                    fflush(this->file);
+                }
+            }
+
+            void Write(const std::string& program, uint32_t threads, uint32_t iterations, Result& result,
+                       const std::vector<std::string>& extra_values = {})
+            {
+                double seconds = result.nanoseconds / 1e9;
+                double throughput = seconds == 0 ? 0 : iterations / seconds;
+                uint64_t p50 = Percentile(result.samples, 0.5);
+                uint64_t p99 = Percentile(result.samples, 0.99);
+                uint64_t p999 = Percentile(result.samples, 0.999);
+                fprintf(this->file, "%s,%u,%u,%.9f,%.1f,%lu,%lu,%lu", program.c_str(), threads, iterations, seconds,
+                        throughput, (unsigned long)p50, (unsigned long)p99, (unsigned long)p999);
+                for (const std::string& value : extra_values)
+                {
+                    fprintf(this->file, ",%s", value.c_str());
+                }
+                fprintf(this->file, "\n");
+                fflush(this->file);
+            }
+    };
+}
+
+#endif //__DYNBAR_BENCH_HPP__
@@ -0,0 +1,406 @@
+#include <atomic>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+#include "DynBar/FlatMultiDynamicBarrier.hpp"
+#include "DynBar/TreeDynamicBarrier.hpp"
+#include "DynBar/TreeMultiDynamicBarrier.hpp"
+
+#include "Bench.hpp"
+
+// Threads keep leaving and rejoining the barrier while it is in use, the way workers come and go under an autoscaler.
+// Every phase, a thread that is in leaves with probability churn, and a thread that is out comes back with the
+// probability that keeps the expected fraction of threads out at out. Threads that are out wait for the next phase
+// before they roll again (once for every phase that went by), so churn is per phase no matter how fast the barrier is.
+// Thread 0 never leaves, so there is always a phase to wait for, and it times every phase like Latency does. Every
+// OptIn and OptOut is timed too. Every thread has its own RNG with a fixed seed, so every run rolls the same numbers.
+// Then the tree barriers get hammered as well: half of the threads (thread 0 included) arrive at them all along, while
+// the other half keep opting in, going through a round and opting out until the first half is done. Nobody waits for a
+// phase to go by before they come back, so this is as much churn as the barrier takes. The flat barriers only let a
+// thread in while nobody is waiting, which under a constant stream of arrivals hardly ever happens, so they sit out.
+// Usage: Churn threads iterations [output.csv]
+
+uint32_t thread_count;
+uint32_t iterations;
+uint32_t warmup;
+
+constexpr uint64_t SEED = 0x5EED;
+constexpr uint32_t PPM = 1000000;
+
+// Counts phases, so every thread knows which one is next, and which barrier of the multi barriers it is at.
+struct CountPhase
+{
+    std::atomic<uint64_t>* phases;
+
+    void operator()() const noexcept
+    {
+        phases->fetch_add(1);
+    }
+};
+
+// Gives every barrier the same interface, so one loop can churn all of them. The multi barriers only let threads in or
+// out between rounds (while everyone is at barrier 0), so threads that are in only leave once every ROUND phases.
+struct Flat
+{
+    static constexpr const char* NAME = "FlatBarrier";
+    static constexpr uint32_t ROUND = 1;
+    DYNBAR::FlatDynamicBarrier<uint16_t, DYNBAR::SpinWait, CountPhase> barrier;
+
+    Flat(uint32_t opted_in, CountPhase completion) : barrier(thread_count, opted_in, completion)
+    {
+    }
+
+    void OptIn(uint32_t tid)
+    {
+        this->barrier.OptIn();
+    }
+
+    void OptOut(uint32_t tid)
+    {
+        this->barrier.OptOut();
+    }
+
+    void Arrive(uint32_t tid, uint64_t phase)
+    {
+        this->barrier.Arrive();
+    }
+};
+
+struct FlatMulti
+{
+    static constexpr const char* NAME = "FlatMultiBarrier";
+    static constexpr uint32_t ROUND = 2;
+    DYNBAR::FlatMultiDynamicBarrier<uint16_t, DYNBAR::SpinWait, CountPhase> barrier;
+
+    FlatMulti(uint32_t opted_in, CountPhase completion) : barrier(2, thread_count, opted_in, completion)
+    {
+    }
+
+    void OptIn(uint32_t tid)
+    {
+        this->barrier.OptIn();
+    }
+
+    void OptOut(uint32_t tid)
+    {
+        this->barrier.OptOut();
+    }
+
+    void Arrive(uint32_t tid, uint64_t phase)
+    {
+        this->barrier.Arrive(phase & 1);
+    }
+};
+
+struct Tree
+{
+    static constexpr const char* NAME = "TreeBarrier";
+    static constexpr uint32_t ROUND = 1;
+    DYNBAR::TreeDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase> barrier;
+
+    Tree(uint32_t opted_in, CountPhase completion) : barrier(thread_count, opted_in, completion)
+    {
+    }
+
+    void OptIn(uint32_t tid)
+    {
+        this->barrier.OptIn(tid);
+    }
+
+    void OptOut(uint32_t tid)
+    {
+        this->barrier.OptOut(tid);
+    }
+
+    void Arrive(uint32_t tid, uint64_t phase)
+    {
+        this->barrier.Arrive(tid);
+    }
+};
+
+struct TreeMulti
+{
+    static constexpr const char* NAME = "TreeMultiBarrier";
+    static constexpr uint32_t ROUND = 2;
+    DYNBAR::TreeMultiDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase> barrier;
+
+    TreeMulti(uint32_t opted_in, CountPhase completion) : barrier(2, thread_count, opted_in, completion)
+    {
+    }
+
+    void OptIn(uint32_t tid)
+    {
+        this->barrier.OptIn(tid);
+    }
+
+    void OptOut(uint32_t tid)
+    {
+        this->barrier.OptOut(tid);
+    }
+
+    void Arrive(uint32_t tid, uint64_t phase)
+    {
+        this->barrier.Arrive(tid, phase & 1);
+    }
+};
+
+struct ChurnResult
+{
+    BENCH::Result phases;
+    std::vector<uint64_t> opt_ins;
+    std::vector<uint64_t> opt_outs;
+};
+
+// churn and out are in parts per million
+template <typename Barrier>
+ChurnResult Churn(uint32_t churn, uint32_t out)
+{
+    ChurnResult result;
+    result.phases.samples.resize(iterations);
+    std::atomic<uint64_t> phases(0);
+    // Thread 0 is always in, and the last threads start out
+    uint32_t opted_in = thread_count - uint32_t(uint64_t(thread_count - 1) * out / PPM);
+    // Coming back with probability churn * (1 - out) / out makes as many threads come back as leave, on average, when
+    // a fraction out of them is out.
+    uint32_t rejoin = std::min<uint64_t>(PPM, uint64_t(churn) * (PPM - out) / std::max(out, 1u));
+    Barrier barrier(opted_in, CountPhase{&phases});
+    std::vector<std::vector<uint64_t>> opt_ins(thread_count);
+    std::vector<std::vector<uint64_t>> opt_outs(thread_count);
+
+    std::vector<std::thread> workers;
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        workers.emplace_back([&, tid]()
+        {
+            BENCH::Pin(tid, thread_count);
+            std::mt19937_64 rng(SEED + tid);
+            bool in = tid < opted_in;
+            BENCH::Clock::time_point start;
+            BENCH::Clock::time_point last;
+            for (uint64_t phase = phases.load(); phase < warmup + iterations; phase = phases.load())
+            {
+                // A thread that is out may not look until a few phases went by, so it rolls once for each of them. A
+                // thread that is in rolls for a whole round at once.
+                uint64_t rolls = (phase + 1) % Barrier::ROUND == 0 ? Barrier::ROUND : 0;
+                if (in)
+                {
+                    barrier.Arrive(tid, phase);
+                }
+                else
+                {
+                    while (phases.load() == phase)
+                    {
+                        std::this_thread::yield();
+                    }
+                    rolls = phases.load() - phase;
+                }
+                if (tid == 0)
+                {
+                    BENCH::Clock::time_point now = BENCH::Clock::now();
+                    if (phase == warmup - 1)
+                    {
+                        start = now;
+                    }
+                    else if (phase >= warmup)
+                    {
+                        result.phases.samples[phase - warmup] = BENCH::Nanoseconds(now - last);
+                    }
+                    last = now;
+                    continue;
+                }
+                bool flip = false;
+                for (uint64_t i = 0; i < rolls && !flip; i++)
+                {
+                    flip = rng() % PPM < (in ? churn : rejoin);
+                }
+                if (!flip)
+                {
+                    continue;
+                }
+                BENCH::Clock::time_point before = BENCH::Clock::now();
+                in ? barrier.OptOut(tid) : barrier.OptIn(tid);
+                uint64_t took = BENCH::Nanoseconds(BENCH::Clock::now() - before);
+                if (phase >= warmup)
+                {
+                    (in ? opt_outs : opt_ins)[tid].push_back(took);
+                }
+                in = !in;
+            }
+            if (in)
+            {
+                barrier.OptOut(tid);
+            }
+            if (tid == 0)
+            {
+                result.phases.nanoseconds = BENCH::Nanoseconds(last - start);
+            }
+        });
+    }
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        result.opt_ins.insert(result.opt_ins.end(), opt_ins[tid].begin(), opt_ins[tid].end());
+        result.opt_outs.insert(result.opt_outs.end(), opt_outs[tid].begin(), opt_outs[tid].end());
+    }
+    return result;
+}
+
+// Half of the threads arrive warmup + iterations times, thread 0 timing every phase, and the other half churn as
+// fast as they can until the first half is done. Only the churning threads opt in and out, and time it once the
+// warm-up is over.
+template <typename Barrier>
+ChurnResult Hammer()
+{
+    ChurnResult result;
+    result.phases.samples.resize(iterations);
+    std::atomic<uint64_t> phases(0);
+    uint32_t arriving_threads = thread_count - thread_count / 2;
+    std::atomic<uint32_t> done_threads(0);
+    std::atomic<bool> timing(false);
+    Barrier barrier(arriving_threads, CountPhase{&phases});
+    std::vector<std::vector<uint64_t>> opt_ins(thread_count);
+    std::vector<std::vector<uint64_t>> opt_outs(thread_count);
+
+    std::vector<std::thread> workers;
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        workers.emplace_back([&, tid]()
+        {
+            BENCH::Pin(tid, thread_count);
+            if (tid < arriving_threads)
+            {
+                for (uint64_t phase = 0; phase < warmup; phase++)
+                {
+                    barrier.Arrive(tid, phase);
+                }
+                timing.store(true);
+                BENCH::Clock::time_point start = BENCH::Clock::now();
+                BENCH::Clock::time_point last = start;
+                for (uint64_t phase = warmup; phase < warmup + iterations; phase++)
+                {
+                    barrier.Arrive(tid, phase);
+                    if (tid == 0)
+                    {
+                        BENCH::Clock::time_point now = BENCH::Clock::now();
+                        result.phases.samples[phase - warmup] = BENCH::Nanoseconds(now - last);
+                        last = now;
+                    }
+                }
+                if (tid == 0)
+                {
+                    result.phases.nanoseconds = BENCH::Nanoseconds(last - start);
+                }
+                // The multi barriers only let us out at the end of a round
+                for (uint64_t phase = warmup + iterations; phase % Barrier::ROUND != 0; phase++)
+                {
+                    barrier.Arrive(tid, phase);
+                }
+                barrier.OptOut(tid);
+                done_threads++;
+                return;
+            }
+            while (done_threads.load() != arriving_threads)
+            {
+                BENCH::Clock::time_point before = BENCH::Clock::now();
+                barrier.OptIn(tid);
+                BENCH::Clock::time_point joined = BENCH::Clock::now();
+                // Joining puts us at the start of a round
+                for (uint64_t phase = 0; phase < Barrier::ROUND; phase++)
+                {
+                    barrier.Arrive(tid, phase);
+                }
+                BENCH::Clock::time_point arrived = BENCH::Clock::now();
+                barrier.OptOut(tid);
+                BENCH::Clock::time_point left = BENCH::Clock::now();
+                if (timing.load())
+                {
+                    opt_ins[tid].push_back(BENCH::Nanoseconds(joined - before));
+                    opt_outs[tid].push_back(BENCH::Nanoseconds(left - arrived));
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        result.opt_ins.insert(result.opt_ins.end(), opt_ins[tid].begin(), opt_ins[tid].end());
+        result.opt_outs.insert(result.opt_outs.end(), opt_outs[tid].begin(), opt_outs[tid].end());
+    }
+    return result;
+}
+
+// Parts per million as a plain number, e.g. 0.001 for 1000
+std::string Fraction(uint32_t ppm)
+{
+    std::ostringstream fraction;
+    fraction << ppm / double(PPM);
+    return fraction.str();
+}
+
+void Write(BENCH::CSV& csv, const std::string& program, ChurnResult& result, std::vector<std::string> extra)
+{
+    for (std::vector<uint64_t>* samples : {&result.opt_ins, &result.opt_outs})
+    {
+        extra.push_back(std::to_string(samples->size()));
+        for (double q : {0.5, 0.99, 0.999})
+        {
+            extra.push_back(std::to_string(BENCH::Percentile(*samples, q)));
+        }
+    }
+    csv.Write(program, thread_count, iterations, result.phases, extra);
+}
+
+template <typename Barrier>
+void ChurnAll(BENCH::CSV& csv)
+{
+    for (uint32_t churn : {1000u, 10000u, 100000u})
+    {
+        for (uint32_t out : {250000u, 500000u, 750000u})
+        {
+            ChurnResult result = Churn<Barrier>(churn, out);
+            std::string program = std::string(Barrier::NAME) + " churn " + Fraction(churn) + " out " + Fraction(out);
+            Write(csv, program, result, {Fraction(churn), Fraction(out)});
+        }
+    }
+}
+
+// The hammered barrier has no churn rate to speak of, and half of the threads in and out all the time
+template <typename Barrier>
+void HammerAll(BENCH::CSV& csv)
+{
+    ChurnResult result = Hammer<Barrier>();
+    Write(csv, std::string(Barrier::NAME) + " hammer", result, {"max", Fraction(PPM / 2)});
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " threads iterations [output.csv]\n";
+        return 1;
+    }
+    thread_count = std::max(std::stoi(argv[1]), 2);
+    iterations = std::stoi(argv[2]);
+    warmup = std::max(iterations / 10, 100u);
+    BENCH::CSV csv(argc > 3 ? argv[3] : nullptr, {"Churn (per phase)", "Opted Out", "OptIns", "OptIn p50 (ns)",
+                                                  "OptIn p99 (ns)", "OptIn p99.9 (ns)", "OptOuts", "OptOut p50 (ns)",
+                                                  "OptOut p99 (ns)", "OptOut p99.9 (ns)"});
+    ChurnAll<Flat>(csv);
+    ChurnAll<FlatMulti>(csv);
+    ChurnAll<Tree>(csv);
+    ChurnAll<TreeMulti>(csv);
+    HammerAll<Tree>(csv);
+    HammerAll<TreeMulti>(csv);
+    return 0;
+}
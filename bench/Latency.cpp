@@ -0,0 +1,168 @@
+#include <barrier>
+#include <string>
+#include <iostream>
+
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif // _OPENMP
+
+#include "DynBar/AdaptiveDynamicBarrier.hpp"
+#include "DynBar/FlatDynamicBarrier.hpp"
+#include "DynBar/FlatMultiDynamicBarrier.hpp"
+#include "DynBar/TreeDynamicBarrier.hpp"
+#include "DynBar/TreeMultiDynamicBarrier.hpp"
+
+#include "Bench.hpp"
+
+// Every episode is just a barrier, so the time thread 0 sees between two of them is the latency of one phase, and the
+// number of episodes per second is the throughput. Every barrier gets the same pinned threads and the same warm-up.
+// Usage: Latency threads iterations [output.csv]
+
+uint32_t thread_count;
+uint32_t iterations;
+uint32_t warmup;
+
+BENCH::Result FlatBarrier()
+{
+    DYNBAR::FlatDynamicBarrier<uint16_t> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(); });
+}
+
+BENCH::Result FlatMultiBarrier()
+{
+    DYNBAR::FlatMultiDynamicBarrier<uint16_t> barrier(2, thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(i & 1); });
+}
+
+BENCH::Result TreeBarrier()
+{
+    DYNBAR::TreeDynamicBarrier<2> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid); });
+}
+
+BENCH::Result TreeMultiBarrier()
+{
+    DYNBAR::TreeMultiDynamicBarrier<2> barrier(2, thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid, i & 1); });
+}
+
+// The same flat and tree barriers, but parking (or spinning for a while and then parking) instead of spinning, to see
+// what sleeping costs a phase when every thread has a core to itself
+BENCH::Result FlatParkBarrier()
+{
+    DYNBAR::FlatDynamicBarrier<uint16_t, DYNBAR::ParkWait> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(); });
+}
+
+BENCH::Result FlatHybridBarrier()
+{
+    DYNBAR::FlatDynamicBarrier<uint16_t, DYNBAR::HybridWait<>> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(); });
+}
+
+BENCH::Result TreeParkBarrier()
+{
+    DYNBAR::TreeDynamicBarrier<2, DYNBAR::ParkWait> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid); });
+}
+
+BENCH::Result TreeHybridBarrier()
+{
+    DYNBAR::TreeDynamicBarrier<2, DYNBAR::HybridWait<>> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid); });
+}
+
+BENCH::Result AdaptiveBarrier()
+{
+    DYNBAR::AdaptiveDynamicBarrier<2> barrier(thread_count, thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid); });
+}
+
+BENCH::Result PThreadBarrier()
+{
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, thread_count);
+    BENCH::Result result = BENCH::Run(thread_count, warmup, iterations,
+                                      [&](uint32_t tid, uint32_t i) { pthread_barrier_wait(&barrier); });
+    pthread_barrier_destroy(&barrier);
+    return result;
+}
+
+BENCH::Result StdBarrier()
+{
+    std::barrier<> barrier(thread_count);
+    return BENCH::Run(thread_count, warmup, iterations, [&](uint32_t tid, uint32_t i) { barrier.arrive_and_wait(); });
+}
+
+#ifdef _OPENMP
+// OpenMP owns its threads, so this one cannot go through BENCH::Run, but it measures the same way.
+BENCH::Result OmpBarrier()
+{
+    BENCH::Result result;
+    result.samples.resize(iterations);
+    #pragma omp parallel num_threads(thread_count)
+    {
+        uint32_t tid = omp_get_thread_num();
+        BENCH::Pin(tid, thread_count);
+        for (uint32_t i = 0; i < warmup; i++)
+        {
+            #pragma omp barrier
+        }
+        BENCH::Clock::time_point start = BENCH::Clock::now();
+        BENCH::Clock::time_point last = start;
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            #pragma omp barrier
+            if (tid == 0)
+            {
+                BENCH::Clock::time_point now = BENCH::Clock::now();
+                result.samples[i] = BENCH::Nanoseconds(now - last);
+                last = now;
+            }
+        }
+        if (tid == 0)
+        {
+            result.nanoseconds = BENCH::Nanoseconds(last - start);
+        }
+    }
+    return result;
+}
+#endif // _OPENMP
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " threads iterations [output.csv]\n";
+        return 1;
+    }
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    warmup = std::max(iterations / 10, 100u);
+    BENCH::CSV csv(argc > 3 ? argv[3] : nullptr);
+
+    std::pair<const char*, BENCH::Result (*)()> barriers[] =
+    {
+        {"FlatBarrier", FlatBarrier},
+        {"FlatMultiBarrier", FlatMultiBarrier},
+        {"TreeBarrier", TreeBarrier},
+        {"TreeMultiBarrier", TreeMultiBarrier},
+        {"FlatParkBarrier", FlatParkBarrier},
+        {"FlatHybridBarrier", FlatHybridBarrier},
+        {"TreeParkBarrier", TreeParkBarrier},
+        {"TreeHybridBarrier", TreeHybridBarrier},
+        {"AdaptiveBarrier", AdaptiveBarrier},
+        {"PThreadBarrier", PThreadBarrier},
+        {"StdBarrier", StdBarrier},
+#ifdef _OPENMP
+        {"OmpBarrier", OmpBarrier},
+#endif // _OPENMP
+    };
+    for (auto& [name, run] : barriers)
+    {
+        BENCH::Result result = run();
+        csv.Write(name, thread_count, iterations, result);
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include <pthread.h>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+#include "DynBar/FlatMultiDynamicBarrier.hpp"
+#include "DynBar/TreeDynamicBarrier.hpp"
+#include "DynBar/TreeMultiDynamicBarrier.hpp"
+
+#include "Bench.hpp"
+
+// With real work, threads do not arrive together, and what the barrier costs is mostly its release latency: how long
+// it takes from the last arrival until the last waiter is back. Every thread busy waits for a delay before every
+// Arrive, and timestamps right before it arrives and right after it returns. For every phase, the release latency is
+// the last return minus the last arrival, and the wake latency of every thread is its return minus the last arrival.
+// Delays come from every thread's own RNG with a fixed seed, so every run gets the same delays.
+// Usage: Skew threads iterations [output.csv]
+
+uint32_t thread_count;
+uint32_t iterations;
+uint32_t warmup;
+
+constexpr uint64_t SEED = 0x5EED;
+
+enum class Distribution
+{
+    UNIFORM,        // Everyone waits 0 to 10us
+    STRAGGLER,      // One thread waits 50us (a different one every phase), everyone else does not wait
+    HEAVY_TAIL,     // Everyone waits a Pareto (alpha 1.5) delay of at least 1us, capped at 1ms
+};
+
+const char* Name(Distribution distribution)
+{
+    switch (distribution)
+    {
+        case Distribution::UNIFORM:
+            return "uniform";
+        case Distribution::STRAGGLER:
+            return "straggler";
+        default:
+            return "heavy tail";
+    }
+}
+
+uint64_t Delay(Distribution distribution, std::mt19937_64& rng, uint32_t tid, uint32_t i)
+{
+    switch (distribution)
+    {
+        case Distribution::UNIFORM:
+            return rng() % 10000;
+        case Distribution::STRAGGLER:
+            return i % thread_count == tid ? 50000 : 0;
+        default:
+        {
+            double uniform = (rng() >> 11) * 0x1.0p-53;
+            return std::min(1000.0 / std::pow(1.0 - uniform, 1.0 / 1.5), 1000000.0);
+        }
+    }
+}
+
+// Busy waits, since sleeping for a few microseconds would mostly measure the scheduler
+void Work(uint64_t nanoseconds)
+{
+    BENCH::Clock::time_point until = BENCH::Clock::now() + std::chrono::nanoseconds(nanoseconds);
+    while (BENCH::Clock::now() < until)
+    {
+    }
+}
+
+struct SkewResult
+{
+    BENCH::Result release;
+    std::vector<uint64_t> wakes;
+};
+
+template <typename Arrive>
+SkewResult Skew(Distribution distribution, Arrive arrive)
+{
+    // Every thread only writes its own timestamps, which are read once everyone is done
+    std::vector<std::vector<uint64_t>> arrivals(thread_count, std::vector<uint64_t>(iterations));
+    std::vector<std::vector<uint64_t>> returns(thread_count, std::vector<uint64_t>(iterations));
+    BENCH::Clock::time_point origin = BENCH::Clock::now();
+    std::vector<std::thread> workers;
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        workers.emplace_back([&, tid]()
+        {
+            BENCH::Pin(tid, thread_count);
+            std::mt19937_64 rng(SEED + tid);
+            for (uint32_t i = 0; i < warmup + iterations; i++)
+            {
+                Work(Delay(distribution, rng, tid, i));
+                BENCH::Clock::time_point arrived = BENCH::Clock::now();
+                arrive(tid, i);
+                BENCH::Clock::time_point returned = BENCH::Clock::now();
+                if (i >= warmup)
+                {
+                    arrivals[tid][i - warmup] = BENCH::Nanoseconds(arrived - origin);
+                    returns[tid][i - warmup] = BENCH::Nanoseconds(returned - origin);
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    SkewResult result;
+    result.release.samples.resize(iterations);
+    result.wakes.reserve(uint64_t(thread_count) * iterations);
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint64_t last_arrival = 0;
+        uint64_t last_return = 0;
+        for (uint32_t tid = 0; tid < thread_count; tid++)
+        {
+            last_arrival = std::max(last_arrival, arrivals[tid][i]);
+            last_return = std::max(last_return, returns[tid][i]);
+            first = std::min(first, arrivals[tid][i]);
+        }
+        for (uint32_t tid = 0; tid < thread_count; tid++)
+        {
+            result.wakes.push_back(returns[tid][i] - last_arrival);
+        }
+        result.release.samples[i] = last_return - last_arrival;
+        last = last_return;
+    }
+    result.release.nanoseconds = last - first;
+    return result;
+}
+
+SkewResult FlatBarrier(Distribution distribution)
+{
+    DYNBAR::FlatDynamicBarrier<uint16_t> barrier(thread_count, thread_count);
+    return Skew(distribution, [&](uint32_t tid, uint32_t i) { barrier.Arrive(); });
+}
+
+SkewResult FlatMultiBarrier(Distribution distribution)
+{
+    DYNBAR::FlatMultiDynamicBarrier<uint16_t> barrier(2, thread_count, thread_count);
+    return Skew(distribution, [&](uint32_t tid, uint32_t i) { barrier.Arrive(i & 1); });
+}
+
+SkewResult TreeBarrier(Distribution distribution)
+{
+    DYNBAR::TreeDynamicBarrier<2> barrier(thread_count, thread_count);
+    return Skew(distribution, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid); });
+}
+
+SkewResult TreeMultiBarrier(Distribution distribution)
+{
+    DYNBAR::TreeMultiDynamicBarrier<2> barrier(2, thread_count, thread_count);
+    return Skew(distribution, [&](uint32_t tid, uint32_t i) { barrier.Arrive(tid, i & 1); });
+}
+
+SkewResult PThreadBarrier(Distribution distribution)
+{
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, thread_count);
+    SkewResult result = Skew(distribution, [&](uint32_t tid, uint32_t i) { pthread_barrier_wait(&barrier); });
+    pthread_barrier_destroy(&barrier);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " threads iterations [output.csv]\n";
+        return 1;
+    }
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    warmup = std::max(iterations / 10, 100u);
+    BENCH::CSV csv(argc > 3 ? argv[3] : nullptr, {"Distribution", "Wake p50 (ns)", "Wake p99 (ns)",
+                                                  "Wake p99.9 (ns)"});
+
+    std::pair<const char*, SkewResult (*)(Distribution)> barriers[] =
+    {
+        {"FlatBarrier", FlatBarrier},
+        {"FlatMultiBarrier", FlatMultiBarrier},
+        {"TreeBarrier", TreeBarrier},
+        {"TreeMultiBarrier", TreeMultiBarrier},
+        {"PThreadBarrier", PThreadBarrier},
+    };
+    for (Distribution distribution : {Distribution::UNIFORM, Distribution::STRAGGLER, Distribution::HEAVY_TAIL})
+    {
+        for (auto& [name, run] : barriers)
+        {
+            SkewResult result = run(distribution);
+            std::vector<std::string> extra = {Name(distribution)};
+            for (double q : {0.5, 0.99, 0.999})
+            {
+                extra.push_back(std::to_string(BENCH::Percentile(result.wakes, q)));
+            }
+            csv.Write(std::string(name) + " " + Name(distribution), thread_count, iterations, result.release, extra);
+        }
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 import subprocess
+import sys
 import csv
 import plotly.graph_objs as go
 import plotly.subplots as ps
@@ -33,9 +34,9 @@ def WriteCSV(results):
             for item in data:
                 writer.writerow({"Program": program, "Threads": item[0], "Iterations": item[1], "Execution Time (seconds)": item[2]})
 
-def ReadCSV():
+def ReadCSV(path="Speed.csv"):
     results = {}
-    with open("Speed.csv", "r", newline="") as csvfile:
+    with open(path, "r", newline="") as csvfile:
         reader = csv.DictReader(csvfile)
         for row in reader:
             program = row["Program"]
@@ -47,7 +48,7 @@ def ReadCSV():
             results[program].append((threads, iterations, time_taken))
     return results
 
-def PlotResults(results):
+def PlotResults(results, path="Speed.png"):
     print("Plotting Results")
     unique_threads = sorted(list(set([item[0] for sublist in results.values() for item in sublist])))
     fig = ps.make_subplots(rows=len(unique_threads), cols=1, subplot_titles=[f"Threads: {threads}" for threads in unique_threads])
@@ -72,11 +73,19 @@ def PlotResults(results):
 
     # Set the image width and height
     fig.update_layout(width=1920, height=1080*len(unique_threads), showlegend=True)
-    pio.write_image(fig, "Speed.png", height=1080, width=1920)
+    pio.write_image(fig, path, height=1080, width=1920)
 
 if __name__ == "__main__":
-    programs = ["PThreadBarrier", "FlatBarrier", "TreeBarrier", "FlatMultiBarrier", "TreeMultiBarrier"]
-    threads = [2**i for i in range(4, 7)]  # Powers of 2 from 2 to 64
+    # Plots a CSV that is already there (e.g. the Latency.csv that "make benchmark" writes) instead of running anything
+    if len(sys.argv) > 1:
+        PlotResults(ReadCSV(sys.argv[1]), sys.argv[1].rsplit(".", 1)[0] + ".png")
+        sys.exit(0)
+
+    programs = ["PThreadBarrier", "FlatBarrier", "TreeBarrier", "FlatMultiBarrier", "TreeMultiBarrier",
+                "FlatParkBarrier", "TreeParkBarrier", "FlatMultiParkBarrier", "TreeMultiParkBarrier",
+                "TreePaddedBarrier", "TreeMultiPaddedBarrier", "TreeWideBarrier", "TreeMultiWideBarrier",
+                "TopologyBarrier", "DisseminationBarrier"]
+    threads = [2**i for i in range(4, 8)]  # Powers of 2 from 16 to 128
     iterations_cycle = [i for i in range(1, 10)]
     iterations = []
     for i in range(3, 7):
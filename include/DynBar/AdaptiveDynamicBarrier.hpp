@@ -0,0 +1,132 @@
+#ifndef __DYNBAR_ADAPTIVEDYNAMICBARRIER_HPP__
+#define __DYNBAR_ADAPTIVEDYNAMICBARRIER_HPP__
+
+#include <cstdint>
+#include <atomic>
+#include <concepts>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/FlatDynamicBarrier.hpp"
+#include "DynBar/SwitchPolicy.hpp"
+#include "DynBar/TreeDynamicBarrier.hpp"
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // The flat barrier is faster with a few threads, and the tree barrier with many. This one has both, and moves
+    // between them at phase boundaries as the number of threads opted in changes, so you do not have to pick one up
+    // front. Which one the next phase runs on is up to the switch policy (see SwitchPolicy.hpp).
+    // Moving everyone over is free, because both engines always have the same threads opted in: OptIn and OptOut go
+    // to both, and only arriving goes to just one of them. The one nobody arrives at is never in use, so opting in or
+    // out of it never waits. Both engines get the same completion function, which runs the policy once a phase,
+    // while everyone is still waiting. A thread released from a phase only then looks at which engine to arrive at
+    // next, and a thread that opts in only looks once it is counted in both, so nobody can be left behind on the old
+    // one: the next switch needs a phase to complete, and that needs their arrival.
+    template <uint32_t NodeSize = 2, typename WaitPolicy = SpinWait, typename SwitchPolicy = ThresholdSwitch<>,
+              std::invocable CompletionFunction = NoCompletion>
+    class AdaptiveDynamicBarrier
+    {
+        private:
+            // The completion function of both engines
+            struct Switch
+            {
+                AdaptiveDynamicBarrier* barrier;
+
+                void operator()() const noexcept
+                {
+                    this->barrier->Complete();
+                }
+            };
+
+            FlatDynamicBarrier<uint32_t, WaitPolicy, Switch> flat;
+            TreeDynamicBarrier<NodeSize, WaitPolicy, 1, Switch> tree;
+            // Read by every arrival and only written when switching, so it stays away from the count
+            std::atomic<bool> use_tree;
+            uint64_t switches;
+            [[no_unique_address]] SwitchPolicy policy;
+            [[no_unique_address]] CompletionFunction completion;
+            alignas(64) std::atomic<uint32_t> opted_in;
+
+            // Runs once per phase on whichever thread completes it. Everyone opted in is waiting, so nobody reads
+            // use_tree until we are done.
+            void Complete()
+            {
+                this->completion();
+                bool tree = this->use_tree.load(std::memory_order_relaxed);
+                if (this->policy.UseTree(tree, this->opted_in.load(std::memory_order_relaxed)) != tree)
+                {
+                    this->use_tree.store(!tree);
+                    this->switches++;
+                }
+            }
+
+        public:
+            explicit AdaptiveDynamicBarrier(uint32_t max_threads) : AdaptiveDynamicBarrier(max_threads, 0)
+            {
+            }
+
+            AdaptiveDynamicBarrier(uint32_t max_threads, uint32_t opted_in_threads,
+                                   CompletionFunction completion = CompletionFunction(),
+                                   SwitchPolicy policy = SwitchPolicy()) :
+                                   flat(max_threads, opted_in_threads, Switch{this}),
+                                   tree(max_threads, opted_in_threads, Switch{this}), switches(0),
+                                   policy(std::move(policy)), completion(std::move(completion)),
+                                   opted_in(opted_in_threads)
+            {
+                this->use_tree.store(this->policy.UseTree(false, opted_in_threads));
+            }
+
+            // Opts in logical thread id tid. It may not be opted in already.
+            void OptIn(uint32_t tid)
+            {
+                this->opted_in++;
+                this->tree.OptIn(tid);
+                this->flat.OptIn();
+            }
+
+            // Opts out logical thread id tid. It may not be arriving.
+            void OptOut(uint32_t tid)
+            {
+                this->flat.OptOut();
+                this->tree.OptOut(tid);
+                this->opted_in--;
+            }
+
+            void Arrive(uint32_t tid)
+            {
+                if (this->use_tree.load())
+                {
+                    this->tree.Arrive(tid);
+                }
+                else
+                {
+                    this->flat.Arrive();
+                }
+            }
+
+            // Whether the next phase runs on the tree
+            bool UsingTree() const
+            {
+                return this->use_tree.load();
+            }
+
+            // How many times it switched engines. Only meaningful while nobody is arriving.
+            uint64_t GetSwitches() const
+            {
+                return this->switches;
+            }
+
+            uint32_t GetMaxThreads() const
+            {
+                return this->tree.GetMaxThreads();
+            }
+
+            uint32_t GetOptedInThreads() const
+            {
+                return this->opted_in.load();
+            }
+    };
+}
+
+#endif //__DYNBAR_ADAPTIVEDYNAMICBARRIER_HPP__
@@ -0,0 +1,241 @@
+#ifndef __DYNBAR_ASYNCDYNAMICBARRIER_HPP__
+#define __DYNBAR_ASYNCDYNAMICBARRIER_HPP__
+
+#include <cstdint>
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // Resumes a coroutine right away, on the thread that completed the phase. The last arriver goes through everyone
+    // else before it goes on itself, and nobody can complete the next phase without it, so this never nests deeper
+    // than one phase. Use a scheduler of your own to spread them over your executor instead.
+    struct InlineScheduler
+    {
+        void operator()(std::coroutine_handle<> handle) const
+        {
+            handle.resume();
+        }
+    };
+
+    // A FlatDynamicBarrier for coroutines: co_await ArriveAsync() suspends the coroutine instead of waiting, so a few
+    // executor threads can run many more coroutines than that, all taking part. Every suspended coroutine puts itself
+    // on a lock free list, and whoever completes the phase takes the whole list and hands every coroutine on it to the
+    // scheduler, which is anything that can be called with a std::coroutine_handle<>. The last arriver itself is not
+    // suspended at all.
+    // OptIn and OptOut count coroutines, and work like they do on the FlatDynamicBarrier, with one difference: OptIn
+    // does not wait for the phase in progress to complete, a coroutine that opts in takes part in it right away. That
+    // wait would block an executor thread until everyone else arrives, and they may need that thread to get there.
+    // The only waits left are for a phase that is being completed right now, which takes as long as the completion
+    // function, so they spin.
+    template <std::unsigned_integral T, std::invocable<std::coroutine_handle<>> Scheduler = InlineScheduler,
+              std::invocable CompletionFunction = NoCompletion>
+    class AsyncDynamicBarrier
+    {
+        private:
+            static_assert(sizeof(T) <= 4, "The payload must fit in a lock free 64 bit word");
+
+            // The whole payload is packed into a single integer twice the size of T, so that arriving can be a single
+            // fetch_add instead of a CAS loop. From the least significant bit:
+            // | threads (sizeof(T) * 8 bits) | waiting (sizeof(T) * 8 bits) |
+            // Nobody polls the payload, so unlike the FlatDynamicBarrier, there is no epoch. Releasing the phase only
+            // resets waiting.
+            using Payload = std::conditional_t<sizeof(T) == 1, uint16_t,
+                            std::conditional_t<sizeof(T) == 2, uint32_t, uint64_t>>;
+
+            static constexpr uint32_t WAITING_SHIFT = sizeof(T) * 8;
+            static constexpr Payload THREADS_MASK = (Payload(1) << WAITING_SHIFT) - 1;
+            static constexpr Payload ONE_THREAD = 1;
+            static constexpr Payload ONE_WAITING = Payload(1) << WAITING_SHIFT;
+
+            static T Threads(Payload payload)
+            {
+                return payload & THREADS_MASK;
+            }
+
+            static T Waiting(Payload payload)
+            {
+                return payload >> WAITING_SHIFT;
+            }
+
+            static_assert(std::atomic<Payload>::is_always_lock_free);
+
+        public:
+            class Awaiter;
+
+        private:
+            const T max_threads;
+            std::atomic<Payload> payload;
+            // The coroutines suspended in this phase, pushed in front. Every node is the awaiter of its coroutine,
+            // which lives in the coroutine frame until it is resumed, so the list never allocates.
+            std::atomic<Awaiter*> waiters;
+            [[no_unique_address]] Scheduler scheduler;
+            [[no_unique_address]] CompletionFunction completion;
+
+            // Called by whoever made waiting equal to threads. Everyone in this phase put themselves on the list
+            // before they counted as arrived, so they are all on it, and nobody else can be: the next phase only
+            // starts once we release this one. So we take the list first, then release the phase, and then hand
+            // everyone but self to the scheduler. Once handed over, a coroutine can be resumed and its awaiter gone
+            // at any time, so we read where the next one is before that.
+            void Complete(Payload payload, const Awaiter* self)
+            {
+                Awaiter* waiter = this->waiters.exchange(nullptr);
+                this->completion();
+                this->payload.store(payload & THREADS_MASK);
+                while (waiter != nullptr)
+                {
+                    Awaiter* next = waiter->next;
+                    if (waiter != self)
+                    {
+                        this->scheduler(waiter->handle);
+                    }
+                    waiter = next;
+                }
+            }
+
+            // Waits out a phase that is being completed right now (waiting is equal to threads), and returns the
+            // payload after that
+            Payload Settled()
+            {
+                Payload old_payload = this->payload.load();
+                while (Waiting(old_payload) == Threads(old_payload) && Threads(old_payload) != 0)
+                {
+                    Pause();
+                    old_payload = this->payload.load();
+                }
+                return old_payload;
+            }
+
+        public:
+            // What ArriveAsync hands back to co_await. Suspends the coroutine until everyone arrives, unless it is the
+            // last to arrive, which completes the phase and goes on right away.
+            class Awaiter
+            {
+                private:
+                    friend class AsyncDynamicBarrier;
+                    AsyncDynamicBarrier* barrier;
+                    std::coroutine_handle<> handle;
+                    Awaiter* next;
+
+                    explicit Awaiter(AsyncDynamicBarrier* barrier) : barrier(barrier), next(nullptr)
+                    {
+                    }
+
+                public:
+                    bool await_ready() const noexcept
+                    {
+                        return false;
+                    }
+
+                    bool await_suspend(std::coroutine_handle<> handle)
+                    {
+                        // Get on the list before we count as arrived, so whoever completes the phase finds us there
+                        this->handle = handle;
+                        AsyncDynamicBarrier* barrier = this->barrier;
+                        this->next = barrier->waiters.load();
+                        while (!barrier->waiters.compare_exchange_weak(this->next, this))
+                        {
+                        }
+                        // Once we are counted, we may be resumed (and gone) at any time, so we only use locals after
+                        Payload old_payload = barrier->payload.fetch_add(ONE_WAITING);
+                        if (Waiting(old_payload) + 1 == Threads(old_payload))
+                        {
+                            // We are last to enter, so nobody can resume us, and we do not suspend at all
+                            barrier->Complete(old_payload + ONE_WAITING, this);
+                            return false;
+                        }
+                        return true;
+                    }
+
+                    void await_resume() const noexcept
+                    {
+                    }
+            };
+
+            explicit AsyncDynamicBarrier(T max_threads) : AsyncDynamicBarrier(max_threads, 0)
+            {
+            }
+
+            AsyncDynamicBarrier(T max_threads, T opted_in_threads, Scheduler scheduler = Scheduler(),
+                                CompletionFunction completion = CompletionFunction()) : max_threads(max_threads),
+                                payload(opted_in_threads), waiters(nullptr), scheduler(std::move(scheduler)),
+                                completion(std::move(completion))
+            {
+            }
+
+            // Opts in count coroutines at once. They take part in the phase in progress, if there is one.
+            void OptIn(T count = 1)
+            {
+                Payload old_payload = this->Settled();
+                while (!this->payload.compare_exchange_weak(old_payload, old_payload + count * ONE_THREAD))
+                {
+                    if (Waiting(old_payload) == Threads(old_payload))
+                    {
+                        old_payload = this->Settled();
+                    }
+                }
+            }
+
+            // Opts out count coroutines at once. None of them may be suspended in the barrier. If everyone else
+            // already arrived, we complete the phase for them.
+            void OptOut(T count = 1)
+            {
+                Payload old_payload = this->Settled();
+                Payload new_payload;
+                do
+                {
+                    if (Waiting(old_payload) == Threads(old_payload))
+                    {
+                        old_payload = this->Settled();
+                    }
+                    new_payload = old_payload - count * ONE_THREAD;
+                }
+                while (!this->payload.compare_exchange_weak(old_payload, new_payload));
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
+                {
+                    this->Complete(new_payload, nullptr);
+                }
+            }
+
+            // Counts as our arrival in this phase, and opts us out, without suspending (like
+            // std::barrier::arrive_and_drop). We have not arrived yet, so waiting is less than threads and nobody can
+            // be completing the phase: a single fetch_sub is enough.
+            void ArriveAndOptOut()
+            {
+                Payload new_payload = this->payload.fetch_sub(ONE_THREAD) - ONE_THREAD;
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
+                {
+                    this->Complete(new_payload, nullptr);
+                }
+            }
+
+            // co_await barrier.ArriveAsync() to arrive and suspend until everyone else arrives too
+            [[nodiscard]] Awaiter ArriveAsync()
+            {
+                return Awaiter(this);
+            }
+
+            T GetMaxThreads() const
+            {
+                return this->max_threads;
+            }
+
+            T GetOptedInThreads() const
+            {
+                return Threads(this->payload.load());
+            }
+
+            T GetWaitingThreads() const
+            {
+                return Waiting(this->payload.load());
+            }
+    };
+}
+
+#endif //__DYNBAR_ASYNCDYNAMICBARRIER_HPP__
@@ -0,0 +1,20 @@
+#ifndef __DYNBAR_COMPLETION_HPP__
+#define __DYNBAR_COMPLETION_HPP__
+
+namespace DYNBAR
+{
+    // Every barrier takes a completion function, which runs once per phase, after the last thread arrives and before
+    // anyone is released. It runs on one of the arriving threads (or on the thread opting out, if that is what
+    // completes the phase, except in TreeDynamicBarrier where a waiter takes over), so it must be quick and must not
+    // throw or use the barrier itself.
+
+    // The default completion function. Does nothing, and takes no space in the barrier.
+    struct NoCompletion
+    {
+        void operator()() const noexcept
+        {
+        }
+    };
+}
+
+#endif //__DYNBAR_COMPLETION_HPP__
@@ -0,0 +1,264 @@
+#ifndef __DYNBAR_DISSEMINATIONDYNAMICBARRIER_HPP__
+#define __DYNBAR_DISSEMINATIONDYNAMICBARRIER_HPP__
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // OptIn does not wait for the members to take the new thread in. It only asks, and the thread takes part from the
+    // next phase boundary on: its first Arrive (or OptOut) waits for that boundary first, and then for the phase after
+    // it like everyone else.
+    template <typename WaitPolicy = SpinWait>
+    class DisseminationDynamicBarrier
+    {
+        private:
+            static constexpr uint32_t MAX_ROUNDS = 32;
+
+            // The opted in threads, sorted by tid. A thread's rank is its position in the view, and in round r it
+            // signals the thread 2^r ranks after it. Views only change at phase boundaries, and every view knows the
+            // first phase it is used in.
+            struct View
+            {
+                uint32_t first_phase;
+                uint32_t count;
+                uint32_t* tids;
+            };
+
+            struct alignas(64) Slot
+            {
+                // Written by our partners, one flag per round. A flag holds the phase it was signalled in (shifted left
+                // by 1) and whether the partner knows about a pending membership change (the lowest bit). Flags are
+                // double buffered by the parity of the phase, so a fast partner can never overwrite a flag we have not
+                // read yet.
+                std::atomic<uint32_t> flags[2][MAX_ROUNDS];
+
+                // Only touched by the thread owning the slot
+                alignas(64) uint32_t phase;
+                uint32_t rank;
+                uint32_t view;
+                uint32_t view_version;
+                // Opted in, but not taken in yet
+                bool joining;
+            };
+
+            const uint32_t max_threads;
+
+            Slot* slots;
+            View views[2];
+            std::atomic<uint32_t> current_view;
+            std::atomic<uint32_t> view_version;
+
+            // Membership changes are requested here, and applied at the next phase boundary. Every thread arriving
+            // checks for pending requests, and spreads what it saw along with its signals, so by the end of the phase
+            // everyone agrees whether the view must change.
+            std::mutex membership_mutex;
+            bool* requested;
+            std::atomic<uint32_t> pending;
+
+            void Rebuild(uint32_t first_phase)
+            {
+                // Must be called with the membership mutex held. The view we build into is not used by anyone: every
+                // member moved to the current view at the last phase boundary, and a thread that is still joining
+                // cannot be in a view that is about to be replaced without arriving first.
+                uint32_t next = 1 - this->current_view.load();
+                View& view = this->views[next];
+                view.first_phase = first_phase;
+                view.count = 0;
+                for (uint32_t tid = 0; tid < this->max_threads; tid++)
+                {
+                    if (this->requested[tid])
+                    {
+                        view.tids[view.count++] = tid;
+                    }
+                }
+                this->pending.store(0);
+                this->current_view.store(next);
+                this->view_version.fetch_add(1);
+                WaitPolicy::Notify(this->view_version);
+            }
+
+            void Adopt(uint32_t tid)
+            {
+                // Move to the current view, and find our rank in it. If we are not in it, we just left.
+                Slot& slot = this->slots[tid];
+                slot.view_version = this->view_version.load();
+                slot.view = this->current_view.load();
+                const View& view = this->views[slot.view];
+                slot.phase = view.first_phase;
+                slot.rank = view.count;
+                for (uint32_t i = 0; i < view.count; i++)
+                {
+                    if (view.tids[i] == tid)
+                    {
+                        slot.rank = i;
+                        break;
+                    }
+                }
+            }
+
+            void WaitForView(uint32_t tid)
+            {
+                Slot& slot = this->slots[tid];
+                uint32_t version = this->view_version.load();
+                while (version == slot.view_version)
+                {
+                    WaitPolicy::Wait(this->view_version, version);
+                    version = this->view_version.load();
+                }
+                this->Adopt(tid);
+            }
+
+            // Waits for the phase boundary that takes us in, if we opted in since
+            void TakenIn(uint32_t tid)
+            {
+                Slot& slot = this->slots[tid];
+                if (slot.joining)
+                {
+                    slot.joining = false;
+                    this->WaitForView(tid);
+                }
+            }
+
+            void Disseminate(uint32_t tid, uint32_t changed)
+            {
+                Slot& slot = this->slots[tid];
+                const View& view = this->views[slot.view];
+                uint32_t phase = slot.phase;
+                uint32_t parity = phase & 1;
+                uint32_t signal = (phase << 1) | changed;
+                for (uint32_t round = 0, distance = 1; distance < view.count; round++, distance <<= 1)
+                {
+                    // Signal our partner for this round
+                    uint32_t partner_rank = slot.rank + distance;
+                    if (partner_rank >= view.count)
+                    {
+                        partner_rank -= view.count;
+                    }
+                    std::atomic<uint32_t>& partner_flag = this->slots[view.tids[partner_rank]].flags[parity][round];
+                    partner_flag.store(signal);
+                    WaitPolicy::Notify(partner_flag);
+                    // Then wait for the thread signalling us
+                    std::atomic<uint32_t>& flag = slot.flags[parity][round];
+                    uint32_t value = flag.load();
+                    while ((value >> 1) != (signal >> 1))
+                    {
+                        WaitPolicy::Wait(flag, value);
+                        value = flag.load();
+                    }
+                    // Whatever our partner knows, we now know, and will pass on in the next rounds
+                    signal |= value & 1;
+                }
+                slot.phase = phase + 1;
+                if (signal & 1)
+                {
+                    // Everyone saw the same signals, so everyone agrees the view changes now. The first rank builds
+                    // the new view, the rest wait for it.
+                    if (slot.rank == 0)
+                    {
+                        std::lock_guard<std::mutex> lock(this->membership_mutex);
+                        this->Rebuild(slot.phase);
+                    }
+                    this->WaitForView(tid);
+                }
+            }
+
+        public:
+            explicit DisseminationDynamicBarrier(uint32_t max_threads) : DisseminationDynamicBarrier(max_threads, 0)
+            {
+            }
+
+            DisseminationDynamicBarrier(uint32_t max_threads, uint32_t opted_in_threads) : max_threads(max_threads),
+                                        current_view(0), view_version(0), pending(0)
+            {
+                this->slots = new Slot[max_threads];
+                this->requested = new bool[max_threads];
+                for (uint32_t i = 0; i < 2; i++)
+                {
+                    // Phases start at 1, so the flags (which start at 0) can never look like they were signalled
+                    this->views[i].first_phase = 1;
+                    this->views[i].count = 0;
+                    this->views[i].tids = new uint32_t[max_threads];
+                }
+                // The first view holds the first opted_in_threads threads
+                for (uint32_t tid = 0; tid < max_threads; tid++)
+                {
+                    this->requested[tid] = tid < opted_in_threads;
+                    if (this->requested[tid])
+                    {
+                        this->views[0].tids[this->views[0].count++] = tid;
+                    }
+                    for (uint32_t i = 0; i < 2; i++)
+                    {
+                        for (uint32_t j = 0; j < MAX_ROUNDS; j++)
+                        {
+                            this->slots[tid].flags[i][j].store(0);
+                        }
+                    }
+                    this->slots[tid].joining = false;
+                    this->Adopt(tid);
+                }
+            }
+
+            ~DisseminationDynamicBarrier()
+            {
+                for (uint32_t i = 0; i < 2; i++)
+                {
+                    delete[] this->views[i].tids;
+                }
+                delete[] this->requested;
+                delete[] this->slots;
+            }
+
+            void OptIn(uint32_t tid)
+            {
+                // Request to join. The members take us in at their next phase boundary, and our first arrival waits
+                // for that. If there are no members, nobody would ever take us in, so we build the new view ourselves.
+                std::lock_guard<std::mutex> lock(this->membership_mutex);
+                this->requested[tid] = true;
+                this->pending.fetch_add(1);
+                this->slots[tid].view_version = this->view_version.load();
+                this->slots[tid].joining = true;
+                const View& view = this->views[this->current_view.load()];
+                if (view.count == 0)
+                {
+                    this->Rebuild(view.first_phase);
+                }
+            }
+
+            void OptOut(uint32_t tid)
+            {
+                // Leaving takes effect at a phase boundary too. Until then the others are counting on our signals, so
+                // we take part in one last phase (this counts as our arrival in it) and make sure it changes the view.
+                // If we were not taken in yet, that is the first phase we are in.
+                this->TakenIn(tid);
+                {
+                    std::lock_guard<std::mutex> lock(this->membership_mutex);
+                    this->requested[tid] = false;
+                    this->pending.fetch_add(1);
+                }
+                this->Disseminate(tid, 1);
+            }
+
+            void Arrive(uint32_t tid)
+            {
+                this->TakenIn(tid);
+                this->Disseminate(tid, this->pending.load() != 0);
+            }
+
+            uint32_t GetMaxThreads() const
+            {
+                return this->max_threads;
+            }
+
+            uint32_t GetOptedInThreads() const
+            {
+                return this->views[this->current_view.load()].count;
+            }
+    };
+}
+
+#endif //__DYNBAR_DISSEMINATIONDYNAMICBARRIER_HPP__
@@ -3,142 +3,316 @@
 
 #include <cstdint>
 #include <atomic>
+#include <chrono>
 #include <concepts>
+#include <type_traits>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/WaitPolicy.hpp"
 
 namespace DYNBAR
 {
-    template <std::unsigned_integral T>
+    template <std::unsigned_integral T, typename WaitPolicy = SpinWait,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
     class FlatDynamicBarrier
     {
         private:
-            enum class State : uint8_t
+            static_assert(sizeof(T) <= 4, "The payload must fit in a lock free 64 bit word");
+
+            // The whole payload is packed into a single integer twice the size of T, so that arriving can be a single
+            // fetch_add instead of a CAS loop. From the least significant bit:
+            // | epoch (1 bit) | threads (sizeof(T) * 8 - 1 bits) | waiting (sizeof(T) * 8 bits) |
+            // Instead of draining the waiting threads through an EXITING state, the last thread to arrive resets
+            // waiting and flips the epoch in one go. Waiters only watch for the epoch to change, so there is no exit
+            // phase.
+            using Payload = std::conditional_t<sizeof(T) == 1, uint16_t,
+                            std::conditional_t<sizeof(T) == 2, uint32_t, uint64_t>>;
+
+            static constexpr uint32_t THREADS_SHIFT = 1;
+            static constexpr uint32_t WAITING_SHIFT = sizeof(T) * 8;
+            static constexpr Payload EPOCH_MASK = 1;
+            static constexpr Payload THREADS_MASK = ((Payload(1) << (sizeof(T) * 8 - 1)) - 1) << THREADS_SHIFT;
+            static constexpr Payload ONE_THREAD = Payload(1) << THREADS_SHIFT;
+            static constexpr Payload ONE_WAITING = Payload(1) << WAITING_SHIFT;
+
+            static T Threads(Payload payload)
             {
-                ENTERING = 0,
-                EXITING = 1,
-            };
-            struct alignas(2 * sizeof(T)) Payload
+                return (payload & THREADS_MASK) >> THREADS_SHIFT;
+            }
+
+            static T Waiting(Payload payload)
             {
-                State state : 1;
-                T threads : sizeof(T) * 8 - 1;
-                T waiting : sizeof(T) * 8;
+                return payload >> WAITING_SHIFT;
+            }
 
-                Payload() : state(State::ENTERING), threads(0), waiting(0)
+            static Payload Epoch(Payload payload)
+            {
+                return payload & EPOCH_MASK;
+            }
+
+            // The payload of the next phase: same threads, nobody waiting, flipped epoch.
+            static Payload Release(Payload payload)
+            {
+                return (payload & THREADS_MASK) | (Epoch(payload) ^ EPOCH_MASK);
+            }
+
+            const T max_threads;
+            std::atomic<Payload> payload;
+            [[no_unique_address]] CompletionFunction completion;
+            [[no_unique_address]] Stats stats;
+
+            // A CAS that tells the stats when it has to be retried
+            bool CompareExchange(Payload& old_payload, Payload new_payload, uint32_t self)
+            {
+                if (this->payload.compare_exchange_weak(old_payload, new_payload))
                 {
+                    return true;
                 }
+                this->stats.CasFailure(self);
+                return false;
+            }
 
-                Payload(T waiting, T threads) : state(State::ENTERING), threads(threads), waiting(waiting)
+            static_assert(std::atomic<Payload>::is_always_lock_free);
+
+        public:
+            // What ArriveNoWait hands back: the epoch we arrived in. Our arrival is needed for the next phase to
+            // complete, so the epoch cannot flip back before we wait for it.
+            class Token
+            {
+                friend class FlatDynamicBarrier;
+                Payload epoch;
+
+                explicit Token(Payload epoch) : epoch(epoch)
                 {
                 }
             };
 
-            const T max_threads;
-            std::atomic<Payload> payload;
-
-        public:
-            explicit FlatDynamicBarrier(T max_threads) : max_threads(max_threads), payload(Payload(0, 0))
+            explicit FlatDynamicBarrier(T max_threads) : max_threads(max_threads), payload(0), stats(max_threads)
             {
             }
 
-            FlatDynamicBarrier(T max_threads, T opted_in_threads) : max_threads(max_threads),
-                               payload(Payload(0, opted_in_threads))
+            FlatDynamicBarrier(T max_threads, T opted_in_threads,
+                               CompletionFunction completion = CompletionFunction()) : max_threads(max_threads),
+                               payload(Payload(opted_in_threads) << THREADS_SHIFT), completion(std::move(completion)),
+                               stats(max_threads)
             {
             }
 
-            void OptIn()
+            // Opts in count threads at once (e.g., a whole group of workers), with a single CAS.
+            void OptIn(T count = 1)
             {
-                // Can only increment the threads if the barrier is NOT in use (i.e., waiting == 0 and state is ENTERING).
+                // Can only increment the threads if the barrier is NOT in use (i.e., waiting == 0).
+                const uint32_t self = Stats::Self();
+                this->stats.OptIn(self);
+                const Payload delta = Payload(count) * ONE_THREAD;
                 Payload old_payload = this->payload.load();
-                old_payload.waiting = 0;
-                old_payload.state = State::ENTERING;
-                Payload new_payload = old_payload;
-                new_payload.threads++;
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                while (Waiting(old_payload) != 0)
                 {
-                    old_payload.waiting = 0;
-                    old_payload.state = State::ENTERING;
-                    new_payload = old_payload;
-                    new_payload.threads++;
+                    this->stats.Spin(self);
+                    WaitPolicy::Wait(this->payload, old_payload);
+                    old_payload = this->payload.load();
+                }
+                while (!this->CompareExchange(old_payload, old_payload + delta, self))
+                {
+                    // The barrier is in use, wait for it to be released before retrying.
+                    while (Waiting(old_payload) != 0)
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
                 }
             }
 
-            void OptOut()
+            // Opts out count threads at once. None of them may be waiting in the barrier.
+            void OptOut(T count = 1)
             {
-                // To avoid deadlocks, decrementing threads can happen at any time the state is ENTERING, as long as
-                // waiting is less than threads.
+                // To avoid deadlocks, decrementing threads can happen at any time, as long as waiting is less than
+                // threads (i.e., the last thread to arrive is not releasing the barrier right now).
                 // To elaborate on deadlocks, imaging the following scenario:
                 // 1. Thread 1 enters.
                 // 2. Thread 2 tries to decrement, has to wait for all to exit barrier.
                 // 3. Thread 1 will never exit barrier because it is waiting for thread 2 to enter.
                 // 4. Deadlock.
+                const uint32_t self = Stats::Self();
+                this->stats.OptOut(self);
+                const Payload delta = Payload(count) * ONE_THREAD;
                 Payload old_payload = this->payload.load();
-                while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING)
+                Payload new_payload;
+                do
                 {
-                    old_payload = this->payload.load();
+                    while (Waiting(old_payload) == Threads(old_payload))
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
+                    new_payload = old_payload - delta;
                 }
-                Payload new_payload = old_payload;
-                new_payload.threads--;
-                // If after decrementing, waiting is equal to threads, set state to EXITING.
-                if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                // If after decrementing, waiting is equal to threads, we complete the barrier for everyone. Just like
+                // the last thread to arrive, nobody else can change the payload until we release it.
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
                 {
-                    new_payload.state = State::EXITING;
+                    this->stats.LastArriver(self);
+                    this->completion();
+                    this->payload.store(Release(new_payload));
+                    WaitPolicy::Notify(this->payload);
                 }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+            }
+
+            // Opts out a thread that arrived without waiting yet. Its arrival still counts for this phase, and
+            // nobody has to wait for it after that. If the phase is still going, we take it back out of both threads
+            // and waiting, which leaves the phase just as far from done. Never waits for the phase to complete.
+            void OptOut(Token token)
+            {
+                const uint32_t self = Stats::Self();
+                this->stats.OptOut(self);
+                Payload old_payload = this->payload.load();
+                Payload new_payload;
+                do
                 {
-                    while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING)
+                    while (Waiting(old_payload) == Threads(old_payload))
                     {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
                         old_payload = this->payload.load();
                     }
-                    new_payload = old_payload;
-                    new_payload.threads--;
-                    if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
+                    new_payload = old_payload - ONE_THREAD;
+                    if (Epoch(old_payload) == token.epoch)
                     {
-                        new_payload.state = State::EXITING;
+                        new_payload -= ONE_WAITING;
                     }
                 }
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                // If the phase was over and the next one was only waiting for us, we complete it for everyone.
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
+                {
+                    this->stats.LastArriver(self);
+                    this->completion();
+                    this->payload.store(Release(new_payload));
+                    WaitPolicy::Notify(this->payload);
+                }
+                else if (Waiting(new_payload) == 0)
+                {
+                    // We were the only one waiting, and OptIn may be waiting for the barrier to be empty.
+                    WaitPolicy::Notify(this->payload);
+                }
             }
 
-            void Arrive()
+            // Counts as our arrival in this phase, and opts us out, without waiting for anyone (like
+            // std::barrier::arrive_and_drop). We have not arrived yet, so waiting is less than threads and nobody can
+            // be releasing the barrier: a single fetch_sub is enough. If everyone else was waiting for us, we complete
+            // the phase just like the last thread to arrive would.
+            void ArriveAndOptOut()
             {
-                // Enter the barrier, barrier must be in ENTERING state.
-                Payload old_payload = this->payload.load();
-                old_payload.state = State::ENTERING;
-                Payload new_payload = old_payload;
-                new_payload.waiting++;
-                // If we are last to enter, set state to EXITING.
-                if (new_payload.waiting == new_payload.threads)
+                const uint32_t self = Stats::Self();
+                this->stats.OptOut(self);
+                Payload new_payload = this->payload.fetch_sub(ONE_THREAD) - ONE_THREAD;
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
                 {
-                    new_payload.state = State::EXITING;
+                    this->stats.LastArriver(self);
+                    this->completion();
+                    this->payload.store(Release(new_payload));
+                    WaitPolicy::Notify(this->payload);
                 }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+            }
+
+            void Arrive()
+            {
+                this->Wait(this->ArriveNoWait());
+            }
+
+            // Arrives at the barrier, but only waits until deadline. If the others did not all arrive by then, takes
+            // our arrival back and returns false, as if we never arrived. We are still opted in, so we can arrive again
+            // or opt out (and so can a watchdog, for the threads that did not show up). Waits by polling.
+            template <typename Clock, typename Duration>
+            bool TryArriveUntil(const std::chrono::time_point<Clock, Duration>& deadline)
+            {
+                Token token = this->ArriveNoWait();
+                const uint32_t self = Stats::Self();
+                Payload old_payload = this->payload.load();
+                while (Epoch(old_payload) == token.epoch)
                 {
-                    old_payload.state = State::ENTERING;
-                    new_payload = old_payload;
-                    new_payload.waiting++;
-                    if (new_payload.waiting == new_payload.threads)
+                    // If everyone is in, the last thread is releasing the barrier right now, so we just wait for it.
+                    if (Waiting(old_payload) != Threads(old_payload) && Clock::now() >= deadline)
                     {
-                        new_payload.state = State::EXITING;
+                        if (this->CompareExchange(old_payload, old_payload - ONE_WAITING, self))
+                        {
+                            if (Waiting(old_payload) == 1)
+                            {
+                                // OptIn may be waiting for the barrier to be empty.
+                                WaitPolicy::Notify(this->payload);
+                            }
+                            return false;
+                        }
+                        continue;
                     }
+                    this->stats.Spin(self);
+                    WaitPolicy::Poll(this->payload, old_payload);
+                    old_payload = this->payload.load();
                 }
-                // Wait for all threads to enter (state becomes EXITING).
-                while (this->payload.load().state == State::ENTERING);
-                // Then decrement the waiting.
-                old_payload = this->payload.load();
-                new_payload = old_payload;
-                new_payload.waiting--;
-                // If we are last to exit, set state to ENTERING.
-                if (new_payload.waiting == 0)
+                this->stats.Released(self);
+                return true;
+            }
+
+            template <typename Rep, typename Period>
+            bool TryArriveFor(const std::chrono::duration<Rep, Period>& timeout)
+            {
+                return this->TryArriveUntil(std::chrono::steady_clock::now() + timeout);
+            }
+
+            // The first half of Arrive: counts us as arrived, and releases everyone if we are the last. Never waits.
+            // The token must be passed to Wait (or to TryWait until it returns true, or to OptOut) before arriving
+            // again.
+            Token ArriveNoWait()
+            {
+                // Enter the barrier.
+                const uint32_t self = Stats::Self();
+                this->stats.Arrived(self);
+                Payload old_payload = this->payload.fetch_add(ONE_WAITING);
+                if (Waiting(old_payload) + 1 == Threads(old_payload))
                 {
-                    new_payload.state = State::ENTERING;
+                    this->stats.LastArriver(self);
+                    // We are last to enter. Nobody else can change the payload until we release it (OptIn waits for
+                    // waiting to be 0, OptOut waits for waiting to be less than threads), so a plain store is enough.
+                    this->completion();
+                    this->payload.store(Release(old_payload + ONE_WAITING));
+                    WaitPolicy::Notify(this->payload);
                 }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                return Token(Epoch(old_payload));
+            }
+
+            // The second half of Arrive: waits for the last thread to enter (epoch flips).
+            void Wait(Token token)
+            {
+                const uint32_t self = Stats::Self();
+                Payload temp_payload = this->payload.load();
+                while (Epoch(temp_payload) == token.epoch)
                 {
-                    new_payload = old_payload;
-                    new_payload.waiting--;
-                    if (new_payload.waiting == 0)
-                    {
-                        new_payload.state = State::ENTERING;
-                    }
+                    this->stats.Spin(self);
+                    WaitPolicy::Wait(this->payload, temp_payload);
+                    temp_payload = this->payload.load();
                 }
+                this->stats.Released(self);
+            }
+
+            // Returns whether everyone else arrived, without waiting.
+            bool TryWait(Token token)
+            {
+                if (Epoch(this->payload.load()) == token.epoch)
+                {
+                    return false;
+                }
+                this->stats.Released(Stats::Self());
+                return true;
+            }
+
+            Stats& GetStats()
+            {
+                return this->stats;
             }
 
             T GetMaxThreads() const
@@ -148,12 +322,12 @@ namespace DYNBAR
 
             T GetOptedInThreads() const
             {
-                return this->payload.load().threads;
+                return Threads(this->payload.load());
             }
 
             T GetWaitingThreads() const
             {
-                return this->payload.load().waiting;
+                return Waiting(this->payload.load());
             }
     };
 }
@@ -4,10 +4,16 @@
 #include <cstdint>
 #include <atomic>
 #include <concepts>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/WaitPolicy.hpp"
 
 namespace DYNBAR
 {
-    template <std::unsigned_integral T>
+    template <std::unsigned_integral T, typename WaitPolicy = SpinWait,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
     class FlatMultiDynamicBarrier
     {
         private:
@@ -35,39 +41,74 @@ namespace DYNBAR
             const T max_threads;
             const uint8_t max_barriers;
             std::atomic<Payload> payload;
+            [[no_unique_address]] CompletionFunction completion;
+            [[no_unique_address]] Stats stats;
+
+            // A CAS that tells the stats when it has to be retried
+            bool CompareExchange(Payload& old_payload, Payload new_payload, uint32_t self)
+            {
+                if (this->payload.compare_exchange_weak(old_payload, new_payload))
+                {
+                    return true;
+                }
+                this->stats.CasFailure(self);
+                return false;
+            }
+
+            // Called by whoever made waiting equal to threads. Nobody else can change the payload until we release
+            // it (OptIn waits for waiting to be 0, OptOut waits for waiting to be less than threads, and everyone
+            // already arrived), so we can run the completion function first and then release with a plain store.
+            void Complete(Payload payload, uint32_t self)
+            {
+                this->stats.LastArriver(self);
+                this->completion();
+                payload.state = State::EXITING;
+                this->payload.store(payload);
+                WaitPolicy::Notify(this->payload);
+            }
 
         public:
             explicit FlatMultiDynamicBarrier(uint8_t max_barriers, T max_threads) : max_threads(max_threads),
-                               max_barriers(max_barriers), payload()
+                               max_barriers(max_barriers), payload(), stats(max_threads)
             {
             }
 
-            FlatMultiDynamicBarrier(uint8_t max_barriers, T max_threads, T opted_in_threads) : max_threads(max_threads),
-                               max_barriers(max_barriers), payload(Payload(0, 0, opted_in_threads))
+            FlatMultiDynamicBarrier(uint8_t max_barriers, T max_threads, T opted_in_threads,
+                                    CompletionFunction completion = CompletionFunction()) : max_threads(max_threads),
+                                    max_barriers(max_barriers), payload(Payload(0, 0, opted_in_threads)),
+                                    completion(std::move(completion)), stats(max_threads)
             {
             }
 
-            void OptIn()
+            // Opts in count threads at once (e.g., a whole group of workers), with a single CAS.
+            void OptIn(T count = 1)
             {
                 // Can only increment the threads if the barrier is NOT in use (i.e., waiting == 0, index = 0,
                 // and state is ENTERING).
+                const uint32_t self = Stats::Self();
+                this->stats.OptIn(self);
                 Payload old_payload = this->payload.load();
                 old_payload.waiting = 0;
                 old_payload.index = 0;
                 old_payload.state = State::ENTERING;
                 Payload new_payload = old_payload;
-                new_payload.threads++;
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                new_payload.threads += count;
+                while (!this->CompareExchange(old_payload, new_payload, self))
                 {
-                    old_payload.waiting = 0;
-                    old_payload.index = 0;
-                    old_payload.state = State::ENTERING;
+                    // The barrier is in use, wait for it to be released before retrying.
+                    while (old_payload.waiting != 0 || old_payload.index != 0 || old_payload.state != State::ENTERING)
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
                     new_payload = old_payload;
-                    new_payload.threads++;
+                    new_payload.threads += count;
                 }
             }
 
-            void OptOut()
+            // Opts out count threads at once. None of them may be waiting in the barrier.
+            void OptOut(T count = 1)
             {
                 // To avoid deadlocks, decrementing threads can happen at any time the state is ENTERING, as long as
                 // waiting is less than threads and index is 0.
@@ -76,61 +117,74 @@ namespace DYNBAR
                 // 2. Thread 2 tries to decrement, has to wait for all to exit barrier.
                 // 3. Thread 1 will never exit barrier because it is waiting for thread 2 to enter.
                 // 4. Deadlock.
+                const uint32_t self = Stats::Self();
+                this->stats.OptOut(self);
                 Payload old_payload = this->payload.load();
                 while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING ||
                        old_payload.index != 0)
                 {
+                    this->stats.Spin(self);
+                    WaitPolicy::Wait(this->payload, old_payload);
                     old_payload = this->payload.load();
                 }
                 Payload new_payload = old_payload;
-                new_payload.threads--;
-                // If after decrementing, waiting is equal to threads, set state to EXITING.
-                if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
-                {
-                    new_payload.state = State::EXITING;
-                }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                new_payload.threads -= count;
+                while (!this->CompareExchange(old_payload, new_payload, self))
                 {
                     while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING ||
                            old_payload.index != 0)
                     {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
                         old_payload = this->payload.load();
                     }
                     new_payload = old_payload;
-                    new_payload.threads--;
-                    if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
-                    {
-                        new_payload.state = State::EXITING;
-                    }
+                    new_payload.threads -= count;
+                }
+                // If after decrementing, waiting is equal to threads, we complete the barrier for everyone.
+                if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
+                {
+                    this->Complete(new_payload, self);
                 }
             }
 
             void Arrive(uint8_t index)
             {
                 // Enter the barrier, barrier must be in ENTERING state and index must match.
+                const uint32_t self = Stats::Self();
                 Payload old_payload = this->payload.load();
-                old_payload.state = State::ENTERING;
-                old_payload.index = index;
-                Payload new_payload = old_payload;
-                new_payload.waiting++;
-                // If we are last to enter, set state to EXITING.
-                if (new_payload.waiting == new_payload.threads)
-                {
-                    new_payload.state = State::EXITING;
-                }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                Payload new_payload;
+                do
                 {
-                    old_payload.state = State::ENTERING;
-                    old_payload.index = index;
-                    new_payload = old_payload;
-                    new_payload.waiting++;
-                    if (new_payload.waiting == new_payload.threads)
+                    // If the previous phase is still exiting, or the barrier has not come around to our index yet,
+                    // wait for it by only reading the payload. A CAS that cannot succeed would still take the line
+                    // away from the threads arriving at the current index.
+                    while (old_payload.state == State::EXITING || old_payload.index != index)
                     {
-                        new_payload.state = State::EXITING;
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
                     }
+                    new_payload = old_payload;
+                    new_payload.waiting++;
+                }
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                // Only count the wait from when we got in, waiting for our index to come around is not the barrier
+                this->stats.Arrived(self);
+                if (new_payload.waiting == new_payload.threads)
+                {
+                    // We are last to enter, set state to EXITING and wake up everyone waiting for us.
+                    this->Complete(new_payload, self);
                 }
                 // Wait for all threads to enter (state becomes EXITING).
-                while (this->payload.load().state == State::ENTERING);
+                Payload temp_payload = this->payload.load();
+                while (temp_payload.state == State::ENTERING)
+                {
+                    this->stats.Spin(self);
+                    WaitPolicy::Wait(this->payload, temp_payload);
+                    temp_payload = this->payload.load();
+                }
+                this->stats.Released(self);
                 // Then decrement the waiting.
                 old_payload = this->payload.load();
                 new_payload = old_payload;
@@ -145,7 +199,7 @@ namespace DYNBAR
                         new_payload.index = 0;
                     }
                 }
-                while (!this->payload.compare_exchange_weak(old_payload, new_payload))
+                while (!this->CompareExchange(old_payload, new_payload, self))
                 {
                     new_payload = old_payload;
                     new_payload.waiting--;
@@ -159,6 +213,16 @@ namespace DYNBAR
                         }
                     }
                 }
+                if (new_payload.state == State::ENTERING)
+                {
+                    // We were last to exit, wake up everyone waiting for the barrier to be released.
+                    WaitPolicy::Notify(this->payload);
+                }
+            }
+
+            Stats& GetStats()
+            {
+                return this->stats;
             }
 
             T GetMaxThreads() const
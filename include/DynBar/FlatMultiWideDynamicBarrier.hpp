@@ -0,0 +1,273 @@
+#ifndef __DYNBAR_FLATMULTIWIDEDYNAMICBARRIER_HPP__
+#define __DYNBAR_FLATMULTIWIDEDYNAMICBARRIER_HPP__
+
+#include <cstdint>
+#include <atomic>
+#include <concepts>
+#include <stdexcept>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // A FlatMultiDynamicBarrier with a 64 bit payload whose fields you size yourself. The regular one spends a byte on
+    // the state and the index, so it can only rotate through 127 barriers. Here the index gets IndexBits, so you can
+    // have up to 2^IndexBits barriers, and the thread counts get ThreadBits each, for up to 2^ThreadBits - 1 threads.
+    // By default that is 32768 barriers and 16 million threads. It all has to fit in 64 bits, because that is the
+    // widest CAS that is lock free everywhere.
+    template <uint32_t ThreadBits = 24, uint32_t IndexBits = 15, typename WaitPolicy = SpinWait,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
+    class FlatMultiWideDynamicBarrier
+    {
+        private:
+            static_assert(ThreadBits > 0 && IndexBits > 0, "Every field needs at least a bit");
+            static_assert(1 + IndexBits + 2 * ThreadBits <= 64, "The payload must fit in a lock free 64 bit word");
+
+            enum class State : uint64_t
+            {
+                ENTERING = 0,
+                EXITING = 1,
+            };
+
+            // The payload is a plain integer rather than bitfields, so the bits nobody uses are always 0 and never
+            // make a CAS fail. From the least significant bit:
+            // | state (1 bit) | index (IndexBits) | threads (ThreadBits) | waiting (ThreadBits) | unused |
+            using Payload = uint64_t;
+
+            static constexpr uint32_t INDEX_SHIFT = 1;
+            static constexpr uint32_t THREADS_SHIFT = INDEX_SHIFT + IndexBits;
+            static constexpr uint32_t WAITING_SHIFT = THREADS_SHIFT + ThreadBits;
+            static constexpr Payload STATE_MASK = 1;
+            static constexpr Payload INDEX_MASK = ((Payload(1) << IndexBits) - 1) << INDEX_SHIFT;
+            static constexpr Payload THREADS_MASK = ((Payload(1) << ThreadBits) - 1) << THREADS_SHIFT;
+            static constexpr Payload WAITING_MASK = ((Payload(1) << ThreadBits) - 1) << WAITING_SHIFT;
+            static constexpr Payload ONE_THREAD = Payload(1) << THREADS_SHIFT;
+            static constexpr Payload ONE_WAITING = Payload(1) << WAITING_SHIFT;
+
+            static State GetState(Payload payload)
+            {
+                return State(payload & STATE_MASK);
+            }
+
+            static uint32_t Index(Payload payload)
+            {
+                return (payload & INDEX_MASK) >> INDEX_SHIFT;
+            }
+
+            static uint32_t Threads(Payload payload)
+            {
+                return (payload & THREADS_MASK) >> THREADS_SHIFT;
+            }
+
+            static uint32_t Waiting(Payload payload)
+            {
+                return (payload & WAITING_MASK) >> WAITING_SHIFT;
+            }
+
+            static Payload Make(State state, uint32_t index, uint32_t threads, uint32_t waiting)
+            {
+                return Payload(state) | (Payload(index) << INDEX_SHIFT) | (Payload(threads) << THREADS_SHIFT) |
+                       (Payload(waiting) << WAITING_SHIFT);
+            }
+
+            // The same counts, ENTERING at index
+            static Payload Entering(Payload payload, uint32_t index)
+            {
+                return (payload & (THREADS_MASK | WAITING_MASK)) | (Payload(index) << INDEX_SHIFT);
+            }
+
+            const uint32_t max_threads;
+            const uint32_t max_barriers;
+            std::atomic<Payload> payload;
+            [[no_unique_address]] CompletionFunction completion;
+            [[no_unique_address]] Stats stats;
+
+            static_assert(std::atomic<Payload>::is_always_lock_free);
+
+            // A CAS that tells the stats when it has to be retried
+            bool CompareExchange(Payload& old_payload, Payload new_payload, uint32_t self)
+            {
+                if (this->payload.compare_exchange_weak(old_payload, new_payload))
+                {
+                    return true;
+                }
+                this->stats.CasFailure(self);
+                return false;
+            }
+
+            // Called by whoever made waiting equal to threads. Nobody else can change the payload until we release
+            // it (OptIn waits for waiting to be 0, OptOut waits for waiting to be less than threads, and everyone
+            // already arrived), so we can run the completion function first and then release with a plain store.
+            void Complete(Payload payload, uint32_t self)
+            {
+                this->stats.LastArriver(self);
+                this->completion();
+                this->payload.store(payload | Payload(State::EXITING));
+                WaitPolicy::Notify(this->payload);
+            }
+
+            static void Validate(uint32_t max_barriers, uint32_t max_threads, uint32_t opted_in_threads)
+            {
+                if (max_barriers == 0 || max_barriers > (uint64_t(1) << IndexBits))
+                {
+                    throw std::invalid_argument("The number of barriers must be between 1 and 2^IndexBits");
+                }
+                if (max_threads >= (uint64_t(1) << ThreadBits))
+                {
+                    throw std::invalid_argument("Too many threads for ThreadBits");
+                }
+                // Within max_threads is also within ThreadBits, past which they would spill into waiting
+                if (opted_in_threads > max_threads)
+                {
+                    throw std::invalid_argument("More threads opted in than max_threads");
+                }
+            }
+
+        public:
+            explicit FlatMultiWideDynamicBarrier(uint32_t max_barriers, uint32_t max_threads) :
+                                                 FlatMultiWideDynamicBarrier(max_barriers, max_threads, 0)
+            {
+            }
+
+            FlatMultiWideDynamicBarrier(uint32_t max_barriers, uint32_t max_threads, uint32_t opted_in_threads,
+                                        CompletionFunction completion = CompletionFunction()) :
+                                        max_threads(max_threads), max_barriers(max_barriers),
+                                        payload(Make(State::ENTERING, 0, opted_in_threads, 0)),
+                                        completion(std::move(completion)), stats(max_threads)
+            {
+                Validate(max_barriers, max_threads, opted_in_threads);
+            }
+
+            // Opts in count threads at once (e.g., a whole group of workers), with a single CAS.
+            void OptIn(uint32_t count = 1)
+            {
+                // Can only increment the threads if the barrier is NOT in use (i.e., waiting == 0, index = 0,
+                // and state is ENTERING).
+                const uint32_t self = Stats::Self();
+                this->stats.OptIn(self);
+                Payload old_payload = this->payload.load() & THREADS_MASK;
+                while (!this->CompareExchange(old_payload, old_payload + count * ONE_THREAD, self))
+                {
+                    // The barrier is in use, wait for it to be released before retrying.
+                    while ((old_payload & ~THREADS_MASK) != 0)
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
+                }
+            }
+
+            // Opts out count threads at once. None of them may be waiting in the barrier.
+            void OptOut(uint32_t count = 1)
+            {
+                // Decrementing threads can happen at any time the state is ENTERING, as long as waiting is less than
+                // threads and index is 0 (see FlatMultiDynamicBarrier::OptOut for the deadlock this avoids).
+                const uint32_t self = Stats::Self();
+                this->stats.OptOut(self);
+                Payload old_payload = this->payload.load();
+                Payload new_payload;
+                do
+                {
+                    while (Waiting(old_payload) == Threads(old_payload) || GetState(old_payload) == State::EXITING ||
+                           Index(old_payload) != 0)
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
+                    new_payload = old_payload - count * ONE_THREAD;
+                }
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                // If after decrementing, waiting is equal to threads, we complete the barrier for everyone.
+                if (Waiting(new_payload) == Threads(new_payload) && Threads(new_payload) != 0)
+                {
+                    this->Complete(new_payload, self);
+                }
+            }
+
+            void Arrive(uint32_t index)
+            {
+                // Enter the barrier, barrier must be in ENTERING state and index must match.
+                const uint32_t self = Stats::Self();
+                Payload old_payload = this->payload.load();
+                Payload new_payload;
+                do
+                {
+                    // If the previous phase is still exiting, or the barrier has not come around to our index yet,
+                    // wait for it by only reading the payload (see FlatMultiDynamicBarrier::Arrive).
+                    while (GetState(old_payload) == State::EXITING || Index(old_payload) != index)
+                    {
+                        this->stats.Spin(self);
+                        WaitPolicy::Wait(this->payload, old_payload);
+                        old_payload = this->payload.load();
+                    }
+                    new_payload = old_payload + ONE_WAITING;
+                }
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                // Only count the wait from when we got in (see FlatMultiDynamicBarrier::Arrive)
+                this->stats.Arrived(self);
+                if (Waiting(new_payload) == Threads(new_payload))
+                {
+                    // We are last to enter, set state to EXITING and wake up everyone waiting for us.
+                    this->Complete(new_payload, self);
+                }
+                // Wait for all threads to enter (state becomes EXITING).
+                Payload temp_payload = this->payload.load();
+                while (GetState(temp_payload) == State::ENTERING)
+                {
+                    this->stats.Spin(self);
+                    WaitPolicy::Wait(this->payload, temp_payload);
+                    temp_payload = this->payload.load();
+                }
+                this->stats.Released(self);
+                // Then decrement the waiting. If we are last to exit, set state to ENTERING and move to the next index.
+                old_payload = this->payload.load();
+                do
+                {
+                    new_payload = old_payload - ONE_WAITING;
+                    if (Waiting(new_payload) == 0)
+                    {
+                        uint32_t next = Index(new_payload) + 1;
+                        new_payload = Entering(new_payload, next == this->max_barriers ? 0 : next);
+                    }
+                }
+                while (!this->CompareExchange(old_payload, new_payload, self));
+                if (GetState(new_payload) == State::ENTERING)
+                {
+                    // We were last to exit, wake up everyone waiting for the barrier to be released.
+                    WaitPolicy::Notify(this->payload);
+                }
+            }
+
+            Stats& GetStats()
+            {
+                return this->stats;
+            }
+
+            uint32_t GetMaxThreads() const
+            {
+                return this->max_threads;
+            }
+
+            uint32_t GetOptedInThreads() const
+            {
+                return Threads(this->payload.load());
+            }
+
+            uint32_t GetWaitingThreads() const
+            {
+                return Waiting(this->payload.load());
+            }
+
+            uint32_t GetMaxBarriers() const
+            {
+                return this->max_barriers;
+            }
+    };
+}
+
+#endif //__DYNBAR_FLATMULTIWIDEDYNAMICBARRIER_HPP__
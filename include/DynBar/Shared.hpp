@@ -0,0 +1,131 @@
+#ifndef __DYNBAR_SHARED_HPP__
+#define __DYNBAR_SHARED_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <sched.h>
+
+namespace DYNBAR
+{
+    // A pointer that holds where it points relative to itself instead of an address. Processes map shared memory
+    // wherever they like, but everything in it stays the same distance apart, so a barrier that only points into its
+    // own mapping this way works at any address. It cannot be copied, a copy would point somewhere else.
+    template <typename T>
+    class OffsetPtr
+    {
+        private:
+            std::ptrdiff_t offset;
+
+        public:
+            OffsetPtr() : offset(0)
+            {
+            }
+
+            OffsetPtr(const OffsetPtr&) = delete;
+            OffsetPtr& operator=(const OffsetPtr&) = delete;
+
+            OffsetPtr& operator=(T* pointer)
+            {
+                this->offset = reinterpret_cast<char*>(pointer) - reinterpret_cast<char*>(this);
+                return *this;
+            }
+
+            T* Get() const
+            {
+                return reinterpret_cast<T*>(const_cast<char*>(reinterpret_cast<const char*>(this)) + this->offset);
+            }
+
+            T& operator[](std::size_t i) const
+            {
+                return this->Get()[i];
+            }
+    };
+
+    // Passed to the tree barriers to have them keep their nodes right behind themselves, instead of allocating them.
+    // There must be room for SharedSize bytes at the barrier. CreateShared takes care of that.
+    struct SharedStorage
+    {
+    };
+
+    // Barriers meant for memory shared between processes (shm_open, memfd_create or MAP_SHARED | MAP_ANONYMOUS before a
+    // fork, and then mmap) go through these. One process creates the barrier, and everyone else attaches to it, at
+    // whatever address they mapped it. A barrier can be shared if it only points into its own memory: the flat
+    // barriers always do, and the tree barriers do when they are created here. Its completion function and stats run
+    // in whichever process gets there, so they must not point anywhere either, and it must wait with SpinWait,
+    // PauseWait, YieldWait or SharedParkWait (ParkWait and HybridWait park on a table that is private to the process).
+    namespace SHARED
+    {
+        // Sits in front of the barrier and tells the processes attaching when it is ready
+        struct alignas(64) Header
+        {
+            static constexpr uint32_t READY = 0x44594E42;
+
+            std::atomic<uint32_t> ready;
+        };
+
+        static_assert(std::atomic<uint32_t>::is_always_lock_free);
+    }
+
+    // How many bytes of shared memory CreateShared needs for a barrier built with args
+    template <typename Barrier, typename... Args>
+    std::size_t SharedSize(const Args&... args)
+    {
+        if constexpr (requires { Barrier::SharedSize(args...); })
+        {
+            return sizeof(SHARED::Header) + Barrier::SharedSize(args...);
+        }
+        else
+        {
+            return sizeof(SHARED::Header) + sizeof(Barrier);
+        }
+    }
+
+    // Builds a barrier in memory, which must be aligned to 64 bytes (mmap always is) and hold SharedSize bytes, with
+    // the same arguments as its constructor. Nobody may attach to it before this returns.
+    template <typename Barrier, typename... Args>
+    Barrier* CreateShared(void* memory, Args&&... args)
+    {
+        static_assert(alignof(Barrier) <= sizeof(SHARED::Header), "The barrier must fit behind the header");
+        SHARED::Header* header = new (memory) SHARED::Header();
+        Barrier* barrier;
+        if constexpr (std::is_constructible_v<Barrier, SharedStorage, Args...>)
+        {
+            barrier = new (header + 1) Barrier(SharedStorage(), std::forward<Args>(args)...);
+        }
+        else
+        {
+            barrier = new (header + 1) Barrier(std::forward<Args>(args)...);
+        }
+        header->ready.store(SHARED::Header::READY);
+        return barrier;
+    }
+
+    // Finds the barrier that CreateShared built in memory, as mapped by this process. If it was not built yet, waits
+    // until it is, so processes can attach as soon as they mapped the memory.
+    template <typename Barrier>
+    Barrier* AttachShared(void* memory)
+    {
+        SHARED::Header* header = static_cast<SHARED::Header*>(memory);
+        while (header->ready.load() != SHARED::Header::READY)
+        {
+            sched_yield();
+        }
+        return std::launder(reinterpret_cast<Barrier*>(header + 1));
+    }
+
+    // Tears down a barrier built by CreateShared, once nobody in any process uses it anymore. The memory is the
+    // caller's to unmap.
+    template <typename Barrier>
+    void DestroyShared(void* memory)
+    {
+        SHARED::Header* header = static_cast<SHARED::Header*>(memory);
+        header->ready.store(0);
+        std::launder(reinterpret_cast<Barrier*>(header + 1))->~Barrier();
+    }
+}
+
+#endif //__DYNBAR_SHARED_HPP__
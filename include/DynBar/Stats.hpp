@@ -0,0 +1,248 @@
+#ifndef __DYNBAR_STATS_HPP__
+#define __DYNBAR_STATS_HPP__
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <memory>
+
+namespace DYNBAR
+{
+    // Every barrier takes a stats policy, which the barrier tells about everything it does on its hot path: every CAS
+    // it has to retry, every time it goes around a wait loop, every OptIn/OptOut, every STUCK node it corrects, how
+    // long every arrival waited, and who completed every phase. The tree barriers tell it the tid doing it. The flat
+    // barriers have no tids, so they ask the policy who the calling thread is with Self().
+
+    // The default policy. Every hook is empty and it takes no space in the barrier, so it compiles to nothing.
+    struct NoStats
+    {
+        explicit NoStats(uint32_t max_threads)
+        {
+        }
+
+        static uint32_t Self()
+        {
+            return 0;
+        }
+
+        void CasFailure(uint32_t tid)
+        {
+        }
+
+        void Spin(uint32_t tid)
+        {
+        }
+
+        void OptIn(uint32_t tid)
+        {
+        }
+
+        void OptOut(uint32_t tid)
+        {
+        }
+
+        void StuckCorrection(uint32_t tid)
+        {
+        }
+
+        void Arrived(uint32_t tid)
+        {
+        }
+
+        void Released(uint32_t tid)
+        {
+        }
+
+        void LastArriver(uint32_t tid)
+        {
+        }
+    };
+
+    // Counts everything, per thread. Every thread gets its own cache lines of counters, so counting does not bounce
+    // lines between cores. Threads are told apart by their tid in the tree barriers, and by Self() in the flat ones,
+    // which numbers threads in the order they first ask. A slot is not always written by one thread only, though: a
+    // flat barrier used by more than max_threads threads over the life of the program shares slots between them, and
+    // the range OptIn/OptOut of the tree barriers count on first_tid from whatever thread calls them. So every count
+    // is a relaxed fetch_add, which is uncontended (and cheap) as long as the slot is not shared.
+    class BarrierStats
+    {
+        public:
+            // Waits are sorted by how many nanoseconds they took: bucket i has the ones that took less than 2^i (and
+            // at least 2^(i - 1)), the last one has everything longer.
+            static constexpr uint32_t HISTOGRAM_BUCKETS = 40;
+
+            struct Counters
+            {
+                uint64_t cas_failures = 0;
+                uint64_t spins = 0;
+                uint64_t opt_ins = 0;
+                uint64_t opt_outs = 0;
+                uint64_t stuck_corrections = 0;
+                uint64_t waits[HISTOGRAM_BUCKETS] = {};
+
+                Counters& operator+=(const Counters& other)
+                {
+                    this->cas_failures += other.cas_failures;
+                    this->spins += other.spins;
+                    this->opt_ins += other.opt_ins;
+                    this->opt_outs += other.opt_outs;
+                    this->stuck_corrections += other.stuck_corrections;
+                    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+                    {
+                        this->waits[i] += other.waits[i];
+                    }
+                    return *this;
+                }
+            };
+
+        private:
+            struct alignas(64) Slot
+            {
+                std::atomic<uint64_t> cas_failures;
+                std::atomic<uint64_t> spins;
+                std::atomic<uint64_t> opt_ins;
+                std::atomic<uint64_t> opt_outs;
+                std::atomic<uint64_t> stuck_corrections;
+                std::atomic<uint64_t> waits[HISTOGRAM_BUCKETS];
+                // When the last arrival on this slot started, in steady_clock ticks. Threads sharing a slot may mix
+                // up each other's stamps, but never tear them.
+                std::atomic<std::chrono::steady_clock::rep> arrived;
+            };
+
+            const uint32_t slot_count;
+            std::unique_ptr<Slot[]> slots;
+            std::atomic<uint32_t> last_arriver;
+
+            Slot& At(uint32_t tid)
+            {
+                return this->slots[tid % this->slot_count];
+            }
+
+            // A slot may be shared (see above), so this has to be a real read-modify-write
+            static void Bump(std::atomic<uint64_t>& counter)
+            {
+                counter.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            static uint64_t Read(const std::atomic<uint64_t>& counter)
+            {
+                return counter.load(std::memory_order_relaxed);
+            }
+
+        public:
+            explicit BarrierStats(uint32_t max_threads) : slot_count(std::max(max_threads, 1u)),
+                                                          slots(std::make_unique<Slot[]>(slot_count)), last_arriver(0)
+            {
+            }
+
+            static uint32_t Self()
+            {
+                static std::atomic<uint32_t> next(0);
+                thread_local uint32_t self = next.fetch_add(1);
+                return self;
+            }
+
+            void CasFailure(uint32_t tid)
+            {
+                Bump(this->At(tid).cas_failures);
+            }
+
+            void Spin(uint32_t tid)
+            {
+                Bump(this->At(tid).spins);
+            }
+
+            void OptIn(uint32_t tid)
+            {
+                Bump(this->At(tid).opt_ins);
+            }
+
+            void OptOut(uint32_t tid)
+            {
+                Bump(this->At(tid).opt_outs);
+            }
+
+            void StuckCorrection(uint32_t tid)
+            {
+                Bump(this->At(tid).stuck_corrections);
+            }
+
+            void Arrived(uint32_t tid)
+            {
+                this->At(tid).arrived.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                                            std::memory_order_relaxed);
+            }
+
+            void Released(uint32_t tid)
+            {
+                Slot& slot = this->At(tid);
+                std::chrono::steady_clock::duration since(slot.arrived.load(std::memory_order_relaxed));
+                auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - std::chrono::steady_clock::time_point(since)).count();
+                uint32_t bucket = std::bit_width(uint64_t(std::max<decltype(waited)>(waited, 0)));
+                Bump(slot.waits[std::min(bucket, HISTOGRAM_BUCKETS - 1)]);
+            }
+
+            void LastArriver(uint32_t tid)
+            {
+                this->last_arriver.store(tid, std::memory_order_relaxed);
+            }
+
+            // The counters of one thread (tid, or Self() of the thread for the flat barriers)
+            Counters Get(uint32_t tid) const
+            {
+                const Slot& slot = this->slots[tid % this->slot_count];
+                Counters counters;
+                counters.cas_failures = Read(slot.cas_failures);
+                counters.spins = Read(slot.spins);
+                counters.opt_ins = Read(slot.opt_ins);
+                counters.opt_outs = Read(slot.opt_outs);
+                counters.stuck_corrections = Read(slot.stuck_corrections);
+                for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+                {
+                    counters.waits[i] = Read(slot.waits[i]);
+                }
+                return counters;
+            }
+
+            // The counters of every thread added up
+            Counters Total() const
+            {
+                Counters total;
+                for (uint32_t i = 0; i < this->slot_count; i++)
+                {
+                    total += this->Get(i);
+                }
+                return total;
+            }
+
+            // Who completed the last phase: the last thread to arrive, or whoever completed it when an OptOut left
+            // everyone else waiting.
+            uint32_t GetLastArriver() const
+            {
+                return this->last_arriver.load(std::memory_order_relaxed);
+            }
+
+            // Zeroes every counter. Nobody may be using the barrier.
+            void Reset()
+            {
+                for (uint32_t i = 0; i < this->slot_count; i++)
+                {
+                    Slot& slot = this->slots[i];
+                    slot.cas_failures.store(0);
+                    slot.spins.store(0);
+                    slot.opt_ins.store(0);
+                    slot.opt_outs.store(0);
+                    slot.stuck_corrections.store(0);
+                    for (uint32_t j = 0; j < HISTOGRAM_BUCKETS; j++)
+                    {
+                        slot.waits[j].store(0);
+                    }
+                }
+            }
+    };
+}
+
+#endif //__DYNBAR_STATS_HPP__
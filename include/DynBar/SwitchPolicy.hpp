@@ -0,0 +1,84 @@
+#ifndef __DYNBAR_SWITCHPOLICY_HPP__
+#define __DYNBAR_SWITCHPOLICY_HPP__
+
+#include <cstdint>
+#include <bit>
+#include <chrono>
+
+namespace DYNBAR
+{
+    // A switch policy decides which engine the AdaptiveDynamicBarrier uses. UseTree() is called once per phase, after
+    // the last thread arrives and before anyone is released, with the engine the phase ran on and the number of
+    // threads opted in, and returns whether the next phase runs on the tree. It is only ever called by one thread at a
+    // time, and every call happens after the previous one, so a policy can keep state without atomics. Like a
+    // completion function, it must be quick.
+
+    // Switches on the number of threads alone: to the tree once High threads are opted in, and back to the flat
+    // barrier once there are Low or fewer. The gap between the two keeps a count that hovers around one of them from
+    // switching every phase.
+    template <uint32_t Low = 16, uint32_t High = 32>
+    struct ThresholdSwitch
+    {
+        static_assert(Low < High, "The flat barrier must take over at fewer threads than the tree does");
+
+        bool UseTree(bool tree, uint32_t threads) const
+        {
+            return tree ? threads > Low : threads >= High;
+        }
+    };
+
+    // Measures instead of guessing. It times Window phases on the engine in use, and then keeps whichever engine had
+    // the shorter phases the last time it was timed with about as many threads (the same power of 2). If the other
+    // engine was never timed with that many threads, or not in the last Explore windows, it tries that one for a
+    // window first. Phases include whatever the threads do between two barriers, so this works best when that is
+    // about the same from phase to phase. The clock starts at the end of the first phase of every window, so the
+    // phase right after a switch is never timed.
+    template <uint32_t Window = 1024, uint32_t Explore = 64>
+    class MeasuredSwitch
+    {
+        private:
+            static_assert(Window > 0, "Every window must time at least a phase");
+
+            using Clock = std::chrono::steady_clock;
+
+            Clock::time_point start;
+            bool timing = false;
+            uint32_t timed = 0;
+            uint64_t windows = 0;
+            // Per engine (flat, then tree): how long a phase took, how many threads there were (as a power of 2),
+            // and in which window, the last time it was timed
+            uint64_t nanoseconds[2] = {};
+            uint32_t width[2] = {UINT32_MAX, UINT32_MAX};
+            uint64_t window[2] = {};
+
+        public:
+            bool UseTree(bool tree, uint32_t threads)
+            {
+                Clock::time_point now = Clock::now();
+                if (!this->timing)
+                {
+                    this->start = now;
+                    this->timing = true;
+                    this->timed = 0;
+                    return tree;
+                }
+                if (++this->timed < Window)
+                {
+                    return tree;
+                }
+                this->timing = false;
+                this->windows++;
+                auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->start).count();
+                this->nanoseconds[tree] = elapsed / Window;
+                this->width[tree] = std::bit_width(threads);
+                this->window[tree] = this->windows;
+                if (this->width[!tree] != this->width[tree] || this->windows - this->window[!tree] >= Explore)
+                {
+                    return !tree;
+                }
+                return this->nanoseconds[!tree] < this->nanoseconds[tree] ? !tree : tree;
+            }
+    };
+}
+
+#endif //__DYNBAR_SWITCHPOLICY_HPP__
@@ -0,0 +1,177 @@
+#ifndef __DYNBAR_TOPOLOGY_HPP__
+#define __DYNBAR_TOPOLOGY_HPP__
+
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace DYNBAR
+{
+    // Describes which CPUs share what. Every CPU gets one key per level, and CPUs with the same key at a level (and at
+    // every level above it) are in the same group at that level. The keys themselves mean nothing, they only need to
+    // be equal within a group, so we use the first CPU of the group.
+    class Topology
+    {
+        public:
+            enum Level : uint32_t
+            {
+                CORE = 0,           // SMT siblings
+                L2 = 1,             // CPUs sharing an L2 cache
+                L3 = 2,             // CPUs sharing an L3 cache
+                NUMA = 3,           // CPUs on the same NUMA node
+                PACKAGE = 4,        // CPUs on the same socket
+                LEVELS = 5,
+            };
+
+            using Keys = std::array<uint32_t, LEVELS>;
+
+        private:
+            std::vector<uint32_t> cpus;
+            std::vector<Keys> keys;
+
+            static bool ReadLine(const std::filesystem::path& path, std::string& line)
+            {
+                std::ifstream file(path);
+                return static_cast<bool>(std::getline(file, line));
+            }
+
+            // Parses the kernel's CPU list format (e.g. "0-3,8,10-11")
+            static std::vector<uint32_t> ParseList(const std::string& list)
+            {
+                std::vector<uint32_t> result;
+                std::size_t start = 0;
+                while (start < list.size())
+                {
+                    std::size_t end = list.find(',', start);
+                    if (end == std::string::npos)
+                    {
+                        end = list.size();
+                    }
+                    std::string range = list.substr(start, end - start);
+                    std::size_t dash = range.find('-');
+                    if (!range.empty())
+                    {
+                        uint32_t first = std::stoul(range.substr(0, dash));
+                        uint32_t last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+                        for (uint32_t cpu = first; cpu <= last; cpu++)
+                        {
+                            result.push_back(cpu);
+                        }
+                    }
+                    start = end + 1;
+                }
+                return result;
+            }
+
+            // The first CPU of a CPU list file, or fallback if there is no such file
+            static uint32_t ReadFirst(const std::filesystem::path& path, uint32_t fallback)
+            {
+                std::string line;
+                if (!ReadLine(path, line))
+                {
+                    return fallback;
+                }
+                std::vector<uint32_t> list = ParseList(line);
+                return list.empty() ? fallback : list.front();
+            }
+
+        public:
+            // Adds a CPU with its keys, from the lowest level to the highest
+            void AddCpu(uint32_t cpu, const Keys& cpu_keys)
+            {
+                if (std::find(this->cpus.begin(), this->cpus.end(), cpu) != this->cpus.end())
+                {
+                    throw std::invalid_argument("CPU " + std::to_string(cpu) + " is already in the topology");
+                }
+                this->cpus.push_back(cpu);
+                this->keys.push_back(cpu_keys);
+            }
+
+            // Reads the topology of the online CPUs from sysfs. Anything the kernel does not tell us is assumed to be
+            // shared by everyone, except for the cores, which are assumed to have no SMT siblings.
+            static Topology Read(const std::filesystem::path& root = "/sys/devices/system/cpu")
+            {
+                std::string line;
+                if (!ReadLine(root / "online", line))
+                {
+                    throw std::runtime_error("Could not read the online CPUs from " + root.string());
+                }
+                Topology topology;
+                for (uint32_t cpu : ParseList(line))
+                {
+                    std::filesystem::path cpu_path = root / ("cpu" + std::to_string(cpu));
+                    Keys cpu_keys = {cpu, cpu, 0, 0, 0};
+                    cpu_keys[CORE] = ReadFirst(cpu_path / "topology" / "thread_siblings_list", cpu);
+                    cpu_keys[L2] = cpu_keys[CORE];
+                    // Caches are listed as index0, index1, ..., and we only care about the data or unified ones
+                    for (uint32_t index = 0; ; index++)
+                    {
+                        std::filesystem::path cache_path = cpu_path / "cache" / ("index" + std::to_string(index));
+                        std::string level, type;
+                        if (!ReadLine(cache_path / "level", level) || !ReadLine(cache_path / "type", type))
+                        {
+                            break;
+                        }
+                        if (type == "Instruction")
+                        {
+                            continue;
+                        }
+                        if (level == "2")
+                        {
+                            cpu_keys[L2] = ReadFirst(cache_path / "shared_cpu_list", cpu_keys[CORE]);
+                        }
+                        else if (level == "3")
+                        {
+                            cpu_keys[L3] = ReadFirst(cache_path / "shared_cpu_list", 0);
+                        }
+                    }
+                    // The NUMA node shows up as a nodeN link in the CPU directory
+                    std::error_code error;
+                    for (const auto& entry : std::filesystem::directory_iterator(cpu_path, error))
+                    {
+                        std::string name = entry.path().filename().string();
+                        if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+                            name.find_first_not_of("0123456789", 4) == std::string::npos)
+                        {
+                            cpu_keys[NUMA] = std::stoul(name.substr(4));
+                            break;
+                        }
+                    }
+                    if (ReadLine(cpu_path / "topology" / "physical_package_id", line) && line != "-1")
+                    {
+                        cpu_keys[PACKAGE] = std::stoul(line);
+                    }
+                    topology.AddCpu(cpu, cpu_keys);
+                }
+                return topology;
+            }
+
+            uint32_t GetCpuCount() const
+            {
+                return this->cpus.size();
+            }
+
+            uint32_t GetCpu(uint32_t index) const
+            {
+                return this->cpus[index];
+            }
+
+            const Keys& GetKeys(uint32_t index) const
+            {
+                return this->keys[index];
+            }
+
+            // The index of a CPU in the topology, or GetCpuCount() if it is not in it
+            uint32_t Find(uint32_t cpu) const
+            {
+                return std::find(this->cpus.begin(), this->cpus.end(), cpu) - this->cpus.begin();
+            }
+    };
+}
+
+#endif //__DYNBAR_TOPOLOGY_HPP__
@@ -0,0 +1,262 @@
+#ifndef __DYNBAR_TOPOLOGYDYNAMICBARRIER_HPP__
+#define __DYNBAR_TOPOLOGYDYNAMICBARRIER_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sched.h>
+
+#include "DynBar/Topology.hpp"
+#include "DynBar/Completion.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/TreeProtocol.hpp"
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // The same barrier as TreeDynamicBarrier, but instead of a uniform node size, the tree follows the hardware: SMT
+    // siblings meet at the leaves, then the cores sharing an L2, an L3, a NUMA node, and finally the sockets meet at
+    // the root. Levels that do not split anything on this machine (e.g., L2 on a machine with a private L2 per core)
+    // are skipped, so every level has whatever fan-out the hardware has at that point. Only the layout is ours, the
+    // nodes go through the same TreeProtocol as the TreeDynamicBarrier, split phase and timed arrival included.
+    template <typename WaitPolicy = SpinWait, std::size_t NodeStride = 1,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
+    class TopologyDynamicBarrier : public TreeProtocol<TopologyDynamicBarrier<WaitPolicy, NodeStride,
+                                                                              CompletionFunction, Stats>,
+                                                       uint32_t, WaitPolicy, NodeStride, CompletionFunction, Stats>
+    {
+        private:
+            // The fan-out is only known at runtime, so the counters are as wide as they can get in 32 bits.
+            using Base = TreeProtocol<TopologyDynamicBarrier, uint32_t, WaitPolicy, NodeStride, CompletionFunction,
+                                      Stats>;
+            friend Base;
+            using typename Base::Payload;
+            using typename Base::Node;
+            using Base::COUNT_BITS;
+            using Base::TREE_ALIGNMENT;
+
+            const Topology topology;
+
+            // The whole tree lives in one allocation, laid out level by level with the root at 0. The fan-out is not
+            // uniform, so unlike TreeDynamicBarrier we cannot compute the parent of a node, and keep it instead.
+            uint32_t* parents;
+
+            uint32_t* cpu_leaves;                   // The leaf of every CPU, in topology order
+            uint32_t* thread_leaves;                // The leaf every tid barriers at
+            uint32_t* thread_cpus;                  // The CPU every tid is mapped to
+
+            // Where TreeProtocol finds its way around the tree
+            uint32_t Leaf(uint32_t tid) const
+            {
+                return this->thread_leaves[tid];
+            }
+
+            uint32_t Parent(uint32_t node) const
+            {
+                return this->parents[node];
+            }
+
+        public:
+            TopologyDynamicBarrier(const Topology& topology, uint32_t max_threads) :
+                                   TopologyDynamicBarrier(topology, max_threads, 0)
+            {
+            }
+
+            TopologyDynamicBarrier(const Topology& topology, uint32_t max_threads, uint32_t opted_in_threads,
+                                   CompletionFunction completion = CompletionFunction()) :
+                                   Base(max_threads, std::move(completion)), topology(topology)
+            {
+                const uint32_t cpu_count = topology.GetCpuCount();
+                if (cpu_count == 0)
+                {
+                    throw std::invalid_argument("The topology must have at least one CPU");
+                }
+                if (max_threads >= (1u << COUNT_BITS) || cpu_count >= (1u << COUNT_BITS))
+                {
+                    throw std::invalid_argument("Too many threads or CPUs for the node payload");
+                }
+
+                // Sort the CPUs from the highest level down, so every group, at every level, is a contiguous run of
+                // CPUs. A CPU starts a new group at a level if its keys at that level or any level above it differ
+                // from the CPU before it.
+                std::vector<uint32_t> order(cpu_count);
+                for (uint32_t i = 0; i < cpu_count; i++)
+                {
+                    order[i] = i;
+                }
+                auto above = [&](uint32_t a, uint32_t b, uint32_t level)
+                {
+                    // Compares two CPUs by their keys from the top level down to level
+                    for (uint32_t l = Topology::LEVELS; l-- > level;)
+                    {
+                        if (topology.GetKeys(a)[l] != topology.GetKeys(b)[l])
+                        {
+                            return topology.GetKeys(a)[l] < topology.GetKeys(b)[l] ? -1 : 1;
+                        }
+                    }
+                    return 0;
+                };
+                std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                {
+                    int compare = above(a, b, 0);
+                    return compare != 0 ? compare < 0 : topology.GetCpu(a) < topology.GetCpu(b);
+                });
+                std::vector<std::vector<uint32_t>> groups(Topology::LEVELS, std::vector<uint32_t>(cpu_count, 0));
+                std::vector<uint32_t> group_count(Topology::LEVELS, 1);
+                for (uint32_t level = 0; level < Topology::LEVELS; level++)
+                {
+                    for (uint32_t i = 1; i < cpu_count; i++)
+                    {
+                        if (above(order[i - 1], order[i], level) != 0)
+                        {
+                            group_count[level]++;
+                        }
+                        groups[level][i] = group_count[level] - 1;
+                    }
+                }
+
+                // Keep the levels that split their parent, from the top down. The root is a single group above
+                // everything, so a level with a single group (e.g., one socket) is skipped too.
+                std::vector<uint32_t> levels;
+                uint32_t last_count = 1;
+                for (uint32_t level = Topology::LEVELS; level-- > 0;)
+                {
+                    if (group_count[level] != last_count)
+                    {
+                        levels.push_back(level);
+                        last_count = group_count[level];
+                    }
+                }
+                this->tree_depth = levels.size() + 1;
+
+                // Lay out the levels one after the other
+                std::vector<uint32_t> level_offsets(this->tree_depth, 0);
+                uint32_t total_nodes = 1;
+                for (uint32_t depth = 1; depth < this->tree_depth; depth++)
+                {
+                    level_offsets[depth] = total_nodes;
+                    total_nodes += group_count[levels[depth - 1]];
+                }
+                this->leaf_offset = level_offsets[this->tree_depth - 1];
+                this->leaf_nodes = total_nodes - this->leaf_offset;
+
+                // Allocate and initialize the whole tree at once
+                this->payload_tree = static_cast<Node*>(::operator new[](total_nodes * sizeof(Node),
+                                                                         std::align_val_t(TREE_ALIGNMENT)));
+                for (uint32_t i = 0; i < total_nodes; i++)
+                {
+                    new (&this->payload_tree[i]) Node();
+                    this->payload_tree[i].payload.store(Payload(0, 0));
+                }
+                this->parents = new uint32_t[total_nodes];
+                this->parents[0] = 0;
+                this->cpu_leaves = new uint32_t[cpu_count];
+                for (uint32_t i = 0; i < cpu_count; i++)
+                {
+                    // Walk down the levels of this CPU, every node's parent is the node we came from
+                    uint32_t node = 0;
+                    for (uint32_t depth = 1; depth < this->tree_depth; depth++)
+                    {
+                        uint32_t child = level_offsets[depth] + groups[levels[depth - 1]][i];
+                        this->parents[child] = node;
+                        node = child;
+                    }
+                    this->cpu_leaves[order[i]] = node;
+                }
+
+                // Until told otherwise, tid i runs on the i-th CPU in topology order, so consecutive tids are as close
+                // to each other as they can be.
+                this->thread_leaves = new uint32_t[max_threads];
+                this->thread_cpus = new uint32_t[max_threads];
+                for (uint32_t tid = 0; tid < max_threads; tid++)
+                {
+                    uint32_t index = order[tid % cpu_count];
+                    this->thread_leaves[tid] = this->cpu_leaves[index];
+                    this->thread_cpus[tid] = topology.GetCpu(index);
+                }
+                // Opt in the specified number of threads
+                this->OptInRange(0, opted_in_threads);
+            }
+
+            explicit TopologyDynamicBarrier(uint32_t max_threads) :
+                                   TopologyDynamicBarrier(Topology::Read(), max_threads)
+            {
+            }
+
+            TopologyDynamicBarrier(uint32_t max_threads, uint32_t opted_in_threads,
+                                   CompletionFunction completion = CompletionFunction()) :
+                                   TopologyDynamicBarrier(Topology::Read(), max_threads, opted_in_threads,
+                                                          std::move(completion))
+            {
+            }
+
+            ~TopologyDynamicBarrier()
+            {
+                delete[] this->thread_cpus;
+                delete[] this->thread_leaves;
+                delete[] this->cpu_leaves;
+                delete[] this->parents;
+                // Nodes are trivially destructible, so we can just free the tree
+                ::operator delete[](this->payload_tree.Get(), std::align_val_t(TREE_ALIGNMENT));
+            }
+
+            // The tables above are ours alone, a copy would free them twice
+            TopologyDynamicBarrier(const TopologyDynamicBarrier&) = delete;
+            TopologyDynamicBarrier& operator=(const TopologyDynamicBarrier&) = delete;
+
+            // Maps tid to the leaf of a CPU. Only call this while tid is opted out.
+            void MapThread(uint32_t tid, uint32_t cpu)
+            {
+                uint32_t index = this->topology.Find(cpu);
+                if (index == this->topology.GetCpuCount())
+                {
+                    throw std::invalid_argument("CPU " + std::to_string(cpu) + " is not in the topology");
+                }
+                this->thread_leaves[tid] = this->cpu_leaves[index];
+                this->thread_cpus[tid] = cpu;
+            }
+
+            // Maps tid to the leaf of the CPU the calling thread is pinned to. If it may run on more than one CPU, it
+            // is mapped to the first of them. Only call this while tid is opted out.
+            void MapThread(uint32_t tid)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                if (sched_getaffinity(0, sizeof(set), &set) != 0)
+                {
+                    throw std::runtime_error("Could not read the affinity of the calling thread");
+                }
+                for (uint32_t i = 0; i < this->topology.GetCpuCount(); i++)
+                {
+                    // Look for the first CPU in the topology order
+                    uint32_t cpu = this->topology.GetCpu(i);
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set))
+                    {
+                        this->MapThread(tid, cpu);
+                        return;
+                    }
+                }
+                throw std::invalid_argument("The calling thread is not allowed on any CPU in the topology");
+            }
+
+            uint32_t GetTreeDepth() const
+            {
+                return this->tree_depth;
+            }
+
+            // The CPU tid is mapped to. Pin the thread using tid there to get the most out of the tree.
+            uint32_t GetCpu(uint32_t tid) const
+            {
+                return this->thread_cpus[tid];
+            }
+    };
+}
+
+#endif //__DYNBAR_TOPOLOGYDYNAMICBARRIER_HPP__
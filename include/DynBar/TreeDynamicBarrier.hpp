@@ -1,420 +1,455 @@
 #ifndef __DYNBAR_TREEDYNAMICBARRIER_HPP__
 #define __DYNBAR_TREEDYNAMICBARRIER_HPP__
 
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <atomic>
-#include <cmath>
+#include <bit>
+#include <concepts>
 #include <functional>
-#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Shared.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/TreeProtocol.hpp"
+#include "DynBar/WaitPolicy.hpp"
 
 namespace DYNBAR
 {
-    class TreeDynamicBarrier
+    template <uint32_t NodeSize, typename WaitPolicy = SpinWait, std::size_t NodeStride = 1,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
+    class TreeDynamicBarrier : public TreeProtocol<TreeDynamicBarrier<NodeSize, WaitPolicy, NodeStride,
+                                                                      CompletionFunction, Stats>,
+                                                   std::conditional_t<(NodeSize <= 4), uint8_t, uint16_t>,
+                                                   WaitPolicy, NodeStride, CompletionFunction, Stats>
     {
         private:
-            enum class State : uint8_t
-            {
-                ENTERING = 0,
-                EXITING = 1,
-                STUCK = 2,
-            };
-            struct Payload
-            {
-                State state : 2;
-                uint8_t threads : 3;
-                uint8_t waiting : 3;
+            // Nodes of up to 4 threads fit their counters in a byte, wider nodes need 16 bits. Either way, the fields
+            // fill the whole payload, so no padding bits get in the way of CAS and waiting.
+            using Base = TreeProtocol<TreeDynamicBarrier, std::conditional_t<(NodeSize <= 4), uint8_t, uint16_t>,
+                                      WaitPolicy, NodeStride, CompletionFunction, Stats>;
+            friend Base;
+            using typename Base::Payload;
+            using typename Base::Node;
+            using typename Base::NoReduction;
+            using Base::TREE_ALIGNMENT;
+
+            static_assert(NodeSize >= 2 && NodeSize <= 64 && (NodeSize & (NodeSize - 1)) == 0,
+                          "Node size must be a power of 2 between 2 and 64");
+            // The shift amount for the node size
+            static constexpr uint32_t SHIFT_AMOUNT = std::countr_zero(NodeSize);
 
-                Payload() : state(State::ENTERING), threads(0), waiting(0)
+            // The whole tree lives in one allocation, laid out level by level like an implicit heap: the root is at 0,
+            // the children of node i are at i * NodeSize + 1 to (i + 1) * NodeSize, and the parent of node i is at
+            // (i - 1) / NodeSize. The allocation is aligned to at least a cache line, so the layout is predictable.
+            // Everything else the barrier needs goes in the same allocation, after the nodes. Created with
+            // SharedStorage, that is right behind the barrier itself, instead of on the heap. We only ever point
+            // into it with offsets, so the barrier works from any address the memory is mapped at (see Shared.hpp).
+            // The nodes themselves are payload_tree, in TreeProtocol, which also runs the whole node protocol.
+            void* allocation;                       // What we have to free, if we allocated it
+
+            // Where ArriveAndReduce leaves values on the way up: every node has a slot per child, and a mask of the
+            // slots filled in this phase. The result of the root is left for everyone to pick up on the way out.
+            OffsetPtr<uint64_t> reduce_slots;
+            OffsetPtr<std::atomic<uint64_t>> reduce_masks;
+            uint64_t reduce_result;
+
+            // Which tids Register handed out, a bit per tid. Every leaf is a run of NodeSize bits in one word.
+            OffsetPtr<std::atomic<uint64_t>> registered;
+
+            static constexpr uint32_t TreeDepth(uint32_t max_threads)
+            {
+                // The smallest depth whose leaves can hold max_threads threads
+                uint32_t depth = 1;
+                uint64_t capacity = NodeSize;
+                while (capacity < max_threads)
                 {
+                    capacity <<= SHIFT_AMOUNT;
+                    depth++;
                 }
+                return depth;
+            }
 
-                Payload(uint8_t threads, uint8_t waiting) : state(State::ENTERING), threads(threads), waiting(waiting)
+            static constexpr uint32_t TotalNodes(uint32_t max_threads)
+            {
+                // Every level has NodeSize times the nodes of the one above it
+                uint32_t total_nodes = 0;
+                uint32_t level_nodes = 1;
+                for (uint32_t i = 0; i < TreeDepth(max_threads); i++)
                 {
+                    total_nodes += level_nodes;
+                    level_nodes <<= SHIFT_AMOUNT;
                 }
-            };
+                return total_nodes;
+            }
 
-            const uint32_t max_threads;
-            const uint32_t node_size;
-            const uint32_t tree_depth;
-            const uint32_t shift_amount;            // The shift amount for the node size
-            uint32_t leaf_nodes;
+            // The size of the allocation, and where the reduction slots and masks and the registered tids start in it.
+            // Every part starts 64 bytes in, at least, so padding and futex words never spill into the next part.
+            static constexpr std::size_t NodesSize(uint32_t max_threads)
+            {
+                return (TotalNodes(max_threads) * sizeof(Node) + TREE_ALIGNMENT - 1) & ~(TREE_ALIGNMENT - 1);
+            }
 
-            std::mutex opt_in_mutex;
+            static constexpr std::size_t MasksStart(uint32_t max_threads)
+            {
+                return NodesSize(max_threads) + std::size_t(TotalNodes(max_threads)) * NodeSize * sizeof(uint64_t);
+            }
 
-            // Atomics are not copyable, so we need to use a pointer to an atomic
-            std::atomic<Payload>** payload_tree;
+            static constexpr std::size_t RegisteredStart(uint32_t max_threads)
+            {
+                return MasksStart(max_threads) + std::size_t(TotalNodes(max_threads)) * sizeof(uint64_t);
+            }
 
-        public:
-            TreeDynamicBarrier(uint32_t node_size, uint32_t max_threads) : max_threads(max_threads),
-                               node_size(node_size), tree_depth(std::log(max_threads + 1) / std::log(node_size)),
-                               shift_amount(std::log2(node_size))
+            static constexpr std::size_t AllocationSize(uint32_t max_threads)
             {
-                // Node size must be a power of 2
-                if ((node_size & (node_size - 1)) != 0)
+                return RegisteredStart(max_threads) + std::size_t((max_threads + 63) / 64) * sizeof(uint64_t);
+            }
+
+            // Where the allocation starts for a barrier created with SharedStorage
+            char* SharedAllocation()
+            {
+                uintptr_t end = reinterpret_cast<uintptr_t>(this) + sizeof(TreeDynamicBarrier);
+                return reinterpret_cast<char*>((end + TREE_ALIGNMENT - 1) & ~uintptr_t(TREE_ALIGNMENT - 1));
+            }
+
+            // Where TreeProtocol finds its way around the tree
+            uint32_t Leaf(uint32_t tid) const
+            {
+                return this->leaf_offset + (tid >> SHIFT_AMOUNT);
+            }
+
+            uint32_t Parent(uint32_t node) const
+            {
+                return (node - 1) >> SHIFT_AMOUNT;
+            }
+
+            // Carries a value up the tree. Every thread that gets to a node leaves what it carries in its slot and
+            // marks it, and whoever takes the node up combines the marked slots and carries that instead. Clearing
+            // the mask then is safe: nobody in the node can arrive again until the phase is over.
+            template <typename V, typename Op>
+            struct Reduction
+            {
+                TreeDynamicBarrier* barrier;
+                V value;
+                Op& op;
+
+                Reduction(TreeDynamicBarrier* barrier, V value, Op& op) : barrier(barrier), value(value), op(op)
                 {
-                    throw std::invalid_argument("Node size must be a power of 2");
                 }
-                // Until we template the payload, we need to make sure the node size is not too big
-                if (node_size > 8)
+
+                void Deposit(uint32_t tid, const uint32_t* path, int32_t level)
                 {
-                    throw std::invalid_argument("Node size must be less than or equal to 8");
+                    // Our slot in the leaf is our place in it, further up it is the place of the child we came from
+                    uint32_t node = path[level];
+                    uint32_t slot = level == (int32_t)this->barrier->tree_depth - 1 ? tid & (NodeSize - 1) :
+                                    (path[level + 1] - 1) & (NodeSize - 1);
+                    std::memcpy(&this->barrier->reduce_slots[node * NodeSize + slot], &this->value, sizeof(V));
+                    this->barrier->reduce_masks[node].fetch_or(uint64_t(1) << slot);
                 }
-                // Allocate the tree
-                this->payload_tree = new std::atomic<Payload>*[this->tree_depth];
-                // Find how many nodes are in every level of the tree and allocate them
-                for (uint32_t i = 0; i < this->tree_depth; i++)
+
+                void Combine(uint32_t node)
                 {
-                    uint32_t nodes = 1;
-                    for (uint32_t j = 0; j < i; j++)
-                    {
-                        nodes *= node_size;
-                    }
-                    this->leaf_nodes = nodes;           // Will keep getting updated until the last level
-                    this->payload_tree[i] = new std::atomic<Payload>[nodes];
-                    // Initialize every node in the level
-                    for (uint32_t j = 0; j < nodes; j++)
+                    uint64_t mask = this->barrier->reduce_masks[node].exchange(0);
+                    uint64_t* slots = &this->barrier->reduce_slots[node * NodeSize];
+                    // We are in there too, so there is at least one
+                    std::memcpy(&this->value, &slots[std::countr_zero(mask)], sizeof(V));
+                    mask &= mask - 1;
+                    while (mask != 0)
                     {
-                        this->payload_tree[i][j].store(Payload(0, 0));
+                        V other = this->value;
+                        std::memcpy(&other, &slots[std::countr_zero(mask)], sizeof(V));
+                        this->value = this->op(this->value, other);
+                        mask &= mask - 1;
                     }
                 }
-            }
 
-            TreeDynamicBarrier(uint32_t node_size, uint32_t max_threads, uint32_t opted_in_threads) :
-                               max_threads(max_threads), node_size(node_size),
-                               tree_depth(std::log(max_threads + 1) / std::log(node_size)),
-                               shift_amount(std::log2(node_size))
-            {
-                // Node size must be a power of 2
-                if ((node_size & (node_size - 1)) != 0)
-                {
-                    throw std::invalid_argument("Node size must be a power of 2");
-                }
-                // Until we template the payload, we need to make sure the node size is not too big
-                if (node_size > 8)
+                void Publish()
                 {
-                    throw std::invalid_argument("Node size must be less than or equal to 8");
+                    std::memcpy(&this->barrier->reduce_result, &this->value, sizeof(V));
                 }
-                // Allocate the tree
-                this->payload_tree = new std::atomic<Payload>*[this->tree_depth];
-                // Find how many nodes are in every level of the tree and allocate them
+            };
+
+            // Lays out the tree in storage, or in an allocation of its own if there is none
+            TreeDynamicBarrier(char* storage, uint32_t max_threads, uint32_t opted_in_threads,
+                               CompletionFunction completion) : Base(max_threads, std::move(completion))
+            {
+                this->tree_depth = TreeDepth(max_threads);
+                // Find how many nodes are in the tree, every level has NodeSize times the nodes of the one above it
+                uint32_t total_nodes = 0;
+                this->leaf_nodes = 1;
                 for (uint32_t i = 0; i < this->tree_depth; i++)
                 {
-                    uint32_t nodes = 1;
-                    for (uint32_t j = 0; j < i; j++)
-                    {
-                        nodes *= node_size;
-                    }
-                    this->leaf_nodes = nodes;           // Will keep getting updated until the last level
-                    this->payload_tree[i] = new std::atomic<Payload>[nodes];
-                    // Initialize every node in the level
-                    for (uint32_t j = 0; j < nodes; j++)
+                    this->leaf_offset = total_nodes;    // Will keep getting updated until the last level
+                    total_nodes += this->leaf_nodes;
+                    if (i != this->tree_depth - 1)
                     {
-                        this->payload_tree[i][j].store(Payload(0, 0));
+                        this->leaf_nodes <<= SHIFT_AMOUNT;
                     }
                 }
-                // Opt in the specified number of threads
-                for (uint32_t i = 0; i < opted_in_threads; i++)
+                // Allocate and initialize the whole tree at once
+                this->allocation = nullptr;
+                if (storage == nullptr)
                 {
-                    this->OptIn(i);
+                    this->allocation = ::operator new[](AllocationSize(max_threads), std::align_val_t(TREE_ALIGNMENT));
+                    storage = static_cast<char*>(this->allocation);
                 }
+                this->payload_tree = reinterpret_cast<Node*>(storage);
+                for (uint32_t i = 0; i < total_nodes; i++)
+                {
+                    new (&this->payload_tree[i]) Node();
+                    this->payload_tree[i].payload.store(Payload(0, 0));
+                }
+                this->reduce_slots = reinterpret_cast<uint64_t*>(storage + NodesSize(max_threads));
+                this->reduce_masks = reinterpret_cast<std::atomic<uint64_t>*>(storage + MasksStart(max_threads));
+                for (uint32_t i = 0; i < total_nodes; i++)
+                {
+                    new (&this->reduce_masks[i]) std::atomic<uint64_t>(0);
+                }
+                // The threads opted in from the start have their tids picked for them, so Register never hands
+                // those out
+                this->registered = reinterpret_cast<std::atomic<uint64_t>*>(storage + RegisteredStart(max_threads));
+                for (uint32_t word = 0; word < (max_threads + 63) / 64; word++)
+                {
+                    new (&this->registered[word]) std::atomic<uint64_t>(0);
+                }
+                for (uint32_t tid = 0; tid < opted_in_threads; tid++)
+                {
+                    this->registered[tid / 64].fetch_or(uint64_t(1) << (tid % 64));
+                }
+                // Opt in the specified number of threads
+                this->OptInRange(0, opted_in_threads);
+            }
+
+        public:
+            explicit TreeDynamicBarrier(uint32_t max_threads) : TreeDynamicBarrier(max_threads, 0)
+            {
+            }
+
+            TreeDynamicBarrier(uint32_t max_threads, uint32_t opted_in_threads,
+                               CompletionFunction completion = CompletionFunction()) :
+                               TreeDynamicBarrier(nullptr, max_threads, opted_in_threads, std::move(completion))
+            {
+            }
+
+            // Builds the barrier with everything it needs right behind itself, where there must be room for
+            // SharedSize bytes from the barrier on, so it can be placed in memory shared between processes. Use
+            // CreateShared (see Shared.hpp) rather than calling this directly.
+            TreeDynamicBarrier(SharedStorage, uint32_t max_threads, uint32_t opted_in_threads = 0,
+                               CompletionFunction completion = CompletionFunction()) :
+                               TreeDynamicBarrier(this->SharedAllocation(), max_threads, opted_in_threads,
+                                                  std::move(completion))
+            {
+            }
+
+            // How many bytes a barrier created with SharedStorage takes, with the same arguments as its constructor
+            template <typename... Rest>
+            static constexpr std::size_t SharedSize(uint32_t max_threads, const Rest&...)
+            {
+                return sizeof(TreeDynamicBarrier) + TREE_ALIGNMENT + AllocationSize(max_threads);
             }
 
             ~TreeDynamicBarrier()
             {
-                for (int32_t i = this->tree_depth - 1; i >= 0; i--)
+                // Everything in the allocation is trivially destructible, so we can just free it
+                if (this->allocation != nullptr)
                 {
-                    delete[] this->payload_tree[i];
+                    ::operator delete[](this->allocation, std::align_val_t(TREE_ALIGNMENT));
                 }
-                delete[] this->payload_tree;
             }
 
-            void OptIn(uint32_t tid)
+            TreeDynamicBarrier(const TreeDynamicBarrier&) = delete;
+            TreeDynamicBarrier& operator=(const TreeDynamicBarrier&) = delete;
+
+        private:
+            // The bits of every leaf in taken that has at least one of its tids taken
+            static uint64_t ActiveLeaves(uint64_t taken)
             {
-                // Can only increment if the barrier is NOT in use (i.e., waiting == 0 and state is ENTERING).
-                // The problem is, the barrier is no longer one unit, and while we can be sure that a leaf node is not
-                // in use, we cannot be sure that the parent node is not in use. Doing it step by step exposes us to races
-                // if/when multiple threads try to opt in in the same node.
-                // To do it all at once, we will use a mutex (opting in is much less frequent than arriving, so I will
-                // bite the bullet). We will lock the whole thing, preventing other threads from opting in, then do the
-                // opt in step by step
-                this->opt_in_mutex.lock();
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
-                while (level >= 0)
+                constexpr uint64_t LEAF = NodeSize == 64 ? ~uint64_t(0) : (uint64_t(1) << NodeSize) - 1;
+                uint64_t active = 0;
+                for (uint32_t shift = 0; shift < 64; shift += NodeSize)
                 {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    old_payload.waiting = 0;
-                    old_payload.state = State::ENTERING;
-                    Payload new_payload = old_payload;
-                    new_payload.threads++;
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
+                    if (((taken >> shift) & LEAF) != 0)
                     {
-                        old_payload.waiting = 0;
-                        old_payload.state = State::ENTERING;
-                        new_payload = old_payload;
-                        new_payload.threads++;
+                        active |= LEAF << shift;
                     }
-                    if (old_payload.threads != 0)
-                    {
-                        break;
-                    }
-                    // We were at 0, must increment parent
-                    level--;
-                    node >>= this->shift_amount;
                 }
-                this->opt_in_mutex.unlock();
+                return active;
             }
 
-            void OptOut(uint32_t tid)
+            // Takes a free tid for Register. The first pass only looks next to tids that are already taken, so we
+            // join a leaf that is counted up the tree already, and opting in stops at the leaf. Only if every such
+            // leaf is full does the second pass take the lowest free tid anywhere. Both go from the low tids up, so
+            // the registered threads stay packed to one side of the tree, and share as many nodes as they can.
+            uint32_t Claim()
             {
-                // To avoid deadlocks, decrementing threads can happen at any time the state is ENTERING, as long as
-                // waiting is less than threads.
-                // To elaborate on deadlocks, imaging the following scenario:
-                // 1. Thread 1 enters.
-                // 2. Thread 2 tries to decrement, has to wait for all to exit barrier.
-                // 3. Thread 1 will never exit barrier because it is waiting for thread 2 to enter.
-                // 4. Deadlock.
-
-                // We do the following:
-                // 1. Find the leaf node we are at.
-                // 2. If the state is EXITING, wait for it to become ENTERING.
-                // 3. If the state is ENTERING, decrement the threads.
-                // 4. If after decrementing, waiting is equal to threads, set state to EXITING.
-                // 5. If after decrementing, number of threads is 0, also decrement the parent node. Repeat if needed
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
-
-                while (level >= 0)
+                const uint32_t words = (this->max_threads + 63) / 64;
+                for (uint32_t pass = 0; pass < 2; pass++)
                 {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING)
-                    {
-                        old_payload = node_payload.load();
-                    }
-                    Payload new_payload = old_payload;
-                    new_payload.threads--;
-                    if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
+                    for (uint32_t word = 0; word < words; word++)
                     {
-                        if (level == 0)
-                        {
-                            // If after decrementing the last level, waiting is equal to threads, set state to EXITING.
-                            new_payload.state = State::EXITING;
-                        }
-                        else
-                        {
-                            // However, if after decrementing other levels, waiting is equal to threads, the waiters
-                            // may be stuck since noone from the upper levels would return to them.
-                            new_payload.state = State::STUCK;
-                        }
-                    }
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                    {
-                        while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING)
-                        {
-                            old_payload = node_payload.load();
-                        }
-                        new_payload = old_payload;
-                        new_payload.threads--;
-                        if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
+                        uint32_t left = this->max_threads - word * 64;
+                        uint64_t valid = left >= 64 ? ~uint64_t(0) : (uint64_t(1) << left) - 1;
+                        uint64_t taken = this->registered[word].load();
+                        while (true)
                         {
-                            if (level == 0)
+                            uint64_t free = ~taken & valid;
+                            if (pass == 0)
                             {
-                                // If after decrementing the last level, waiting is equal to threads, set state to EXITING.
-                                new_payload.state = State::EXITING;
+                                free &= ActiveLeaves(taken);
                             }
-                            else
+                            if (free == 0)
                             {
-                                // However, if after decrementing other levels, waiting is equal to threads, the waiters
-                                // may be stuck since noone from the upper levels would return to them.
-                                new_payload.state = State::STUCK;
+                                break;
+                            }
+                            uint64_t bit = free & -free;
+                            if (this->registered[word].compare_exchange_weak(taken, taken | bit))
+                            {
+                                return word * 64 + std::countr_zero(bit);
                             }
                         }
                     }
-                    // Decrement parent if needed
-                    if (new_payload.threads == 0 && level > 0)
-                    {
-                        level--;
-                        node >>= this->shift_amount;
-                    }
-                    else
-                    {
-                        break;
-                    }
                 }
+                throw std::runtime_error("Every tid of the barrier is taken");
             }
 
-            void Arrive(uint32_t tid)
+            // Gives a tid back to Register, once it is opted out
+            void Unclaim(uint32_t tid)
             {
-                // We know the thread id, so we directly know the leaf node we should barrier at
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
-                // From here, we can loop going up doing the following at every level:
-                // 1. Enter the barrier, barrier must be in ENTERING state.
-                // 2. If we are NOT the last to enter, wait for state to become EXITING.
-                // 3. If we are the last to enter, traverse up the tree and repeat.
-                // 4. If we are at the root level, and this is NOT the last thread to enter, wait for state to change to EXITING.
-                // 5. If we are at the root level, and this is the last thread to enter, set state to EXITING.
-                // 6. Traverse down the tree, setting state to EXITING at every level.
-
-                while (level >= 0)
-                {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    // Step 1
-                    Payload old_payload = node_payload.load();
-                    old_payload.state = State::ENTERING;
-                    Payload new_payload = old_payload;
-                    new_payload.waiting++;
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
+                this->registered[tid / 64].fetch_and(~(uint64_t(1) << (tid % 64)));
+            }
+
+        public:
+            // A tid handed out by Register, opted in for as long as the participant lives. It knows its path up the
+            // tree from the start, so arriving goes straight to its leaf. It opts out when it is destroyed, so it
+            // must not be arriving then, and it must go before the barrier does. It can be moved, but not copied.
+            class Participant
+            {
+                private:
+                    friend class TreeDynamicBarrier;
+                    TreeDynamicBarrier* barrier;
+                    uint32_t tid;
+                    uint32_t path[32];
+
+                    Participant(TreeDynamicBarrier* barrier, uint32_t tid) : barrier(barrier), tid(tid)
                     {
-                        old_payload.state = State::ENTERING;
-                        new_payload = old_payload;
-                        new_payload.waiting++;
+                        this->barrier->Path(tid, this->path);
                     }
 
-                    if (new_payload.waiting != new_payload.threads)
+                    void Leave()
                     {
-                        // Step 2 and 4
-                        while (true)
+                        if (this->barrier != nullptr)
                         {
-                            auto temp_payload = node_payload.load();
-                            if (temp_payload.state == State::ENTERING)
-                            {
-                                continue;
-                            }
-                            else if (temp_payload.state == State::EXITING)
-                            {
-                                break;
-                            }
-                            else
-                            {
-                                // State is STUCK. Pick one thread to continue to next levels, change state to entering
-                                if (temp_payload.waiting == temp_payload.threads)
-                                {
-                                    temp_payload.state = State::ENTERING;
-                                    node_payload.store(temp_payload);
-                                    goto correction;
-                                }
-                                else
-                                {
-                                    continue;
-                                }
-                            }
+                            this->barrier->stats.OptOut(this->tid);
+                            this->barrier->Leave(this->tid, this->path[this->barrier->tree_depth - 1], 1);
+                            this->barrier->Unclaim(this->tid);
+                            this->barrier = nullptr;
                         }
-                        old_payload = node_payload.load();
-                        new_payload = old_payload;
-                        new_payload.waiting--;
-                        // If we are last to exit, set state to ENTERING.
-                        if (new_payload.waiting == 0)
-                        {
-                            new_payload.state = State::ENTERING;
-                        }
-                        while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                        {
-                            new_payload = old_payload;
-                            new_payload.waiting--;
-                            if (new_payload.waiting == 0)
-                            {
-                                new_payload.state = State::ENTERING;
-                            }
-                        }
-                        break;
                     }
-                    else
+
+                public:
+                    // Takes part in nothing, until another participant is moved in
+                    Participant() : barrier(nullptr), tid(0)
                     {
-correction:
-                        if (level == 0)
-                        {
-                            // Step 5
-                            old_payload = node_payload.load();
-                            new_payload = old_payload;
-                            new_payload.state = State::EXITING;
-                            new_payload.waiting--;
-                            // If we are last to exit, set state to ENTERING. (Happens if we are the only thread)
-                            if (new_payload.waiting == 0)
-                            {
-                                new_payload.state = State::ENTERING;
-                            }
-                            while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                            {
-                                new_payload = old_payload;
-                                new_payload.state = State::EXITING;
-                                new_payload.waiting--;
-                                if (new_payload.waiting == 0)
-                                {
-                                    new_payload.state = State::ENTERING;
-                                }
-                            }
-                            break;
-                        }
-                        else
-                        {
-                            // Step 3
-                            level--;
-                            node >>= this->shift_amount;
-                        }
                     }
-                }
 
-                // Step 6
-                while (level < (int32_t)this->tree_depth - 1)
-                {
-                    level++;
-                    node = tid >> (this->shift_amount * (this->tree_depth - level));
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    Payload new_payload = old_payload;
-                    new_payload.state = State::EXITING;
-                    new_payload.waiting--;
-                    // If we are last to exit, set state to ENTERING.
-                    if (new_payload.waiting == 0)
+                    Participant(Participant&& other) noexcept : barrier(std::exchange(other.barrier, nullptr)),
+                                                                tid(other.tid)
                     {
-                        new_payload.state = State::ENTERING;
+                        std::copy(other.path, other.path + 32, this->path);
                     }
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
+
+                    Participant& operator=(Participant&& other) noexcept
                     {
-                        new_payload = old_payload;
-                        new_payload.state = State::EXITING;
-                        new_payload.waiting--;
-                        if (new_payload.waiting == 0)
+                        if (this != &other)
                         {
-                            new_payload.state = State::ENTERING;
+                            this->Leave();
+                            this->barrier = std::exchange(other.barrier, nullptr);
+                            this->tid = other.tid;
+                            std::copy(other.path, other.path + 32, this->path);
                         }
+                        return *this;
                     }
-                }
-            }
 
-            uint32_t GetMaxThreads() const
-            {
-                return this->max_threads;
-            }
+                    Participant(const Participant&) = delete;
+                    Participant& operator=(const Participant&) = delete;
 
-            uint32_t GetNodeSize() const
+                    ~Participant()
+                    {
+                        this->Leave();
+                    }
+
+                    void Arrive()
+                    {
+                        NoReduction reduction;
+                        this->barrier->Arrive(this->tid, this->path, reduction);
+                    }
+
+                    template <typename V, typename Op = std::plus<V>>
+                    V ArriveAndReduce(V value, Op op = Op())
+                    {
+                        static_assert(std::is_trivially_copyable_v<V> && sizeof(V) <= sizeof(uint64_t),
+                                      "Reduced values must be trivially copyable and at most 8 bytes");
+                        Reduction<V, Op> reduction(this->barrier, value, op);
+                        this->barrier->Arrive(this->tid, this->path, reduction);
+                        std::memcpy(&value, &this->barrier->reduce_result, sizeof(V));
+                        return value;
+                    }
+
+                    // Opts out now instead of when it is destroyed, and gives the tid back
+                    void OptOut()
+                    {
+                        this->Leave();
+                    }
+
+                    uint32_t GetTid() const
+                    {
+                        return this->tid;
+                    }
+
+                    explicit operator bool() const
+                    {
+                        return this->barrier != nullptr;
+                    }
+            };
+
+            // Picks a free tid, opts it in, and hands it back as a participant that opts it out again once it is
+            // gone, for when the threads do not have tids of their own. Freed tids are handed out again, preferably
+            // next to threads that are already opted in (see Claim). Throws std::runtime_error if all max_threads of
+            // them are taken. Do not opt in tids by hand that Register may hand out (it already skips the ones opted
+            // in by the constructor).
+            Participant Register()
             {
-                return this->node_size;
+                uint32_t tid = this->Claim();
+                this->OptIn(tid);
+                return Participant(this, tid);
             }
 
-            uint32_t GetOptedInThreads() const
+            // Arrives at the barrier, and combines value with the values of every other thread arriving in this
+            // phase using op, which must be associative and commutative. Every one of them gets the result back.
+            // Threads that are opted out contribute nothing. Everyone in a phase must call this with the same V and
+            // op (or everyone must call Arrive). Values travel through the tree in 8 byte slots, so V must be
+            // trivially copyable and fit in one.
+            template <typename V, typename Op = std::plus<V>>
+            V ArriveAndReduce(uint32_t tid, V value, Op op = Op())
             {
-                // Total number of threads of every node in the leafs
-                uint32_t total_threads = 0;
-                for (uint32_t i = 0; i < this->leaf_nodes; i++)
-                {
-                    total_threads += this->payload_tree[this->tree_depth - 1][i].load().threads;
-                }
-                return total_threads;
+                static_assert(std::is_trivially_copyable_v<V> && sizeof(V) <= sizeof(uint64_t),
+                              "Reduced values must be trivially copyable and at most 8 bytes");
+                Reduction<V, Op> reduction(this, value, op);
+                this->Arrive(tid, reduction);
+                // Nobody can start the next phase without us, so the result stays put until we read it
+                std::memcpy(&value, &this->reduce_result, sizeof(V));
+                return value;
             }
 
-            uint32_t GetWaitingThreads() const
+            uint32_t GetNodeSize() const
             {
-                // Total number of waiting threads of every node in the leafs
-                uint32_t total_threads = 0;
-                for (uint32_t i = 0; i < this->leaf_nodes; i++)
-                {
-                    total_threads += this->payload_tree[this->tree_depth - 1][i].load().waiting;
-                }
-                return total_threads;
+                return NodeSize;
             }
     };
 }
@@ -1,460 +1,271 @@
 #ifndef __DYNBAR_TREEMULTIDYNAMICBARRIER_HPP__
 #define __DYNBAR_TREEMULTIDYNAMICBARRIER_HPP__
 
+#include <cstddef>
 #include <cstdint>
 #include <atomic>
-#include <cmath>
+#include <bit>
+#include <chrono>
+#include <concepts>
 #include <functional>
-#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Shared.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/TreeProtocol.hpp"
+#include "DynBar/WaitPolicy.hpp"
 
 namespace DYNBAR
 {
-    class TreeMultiDynamicBarrier
+    template <uint32_t NodeSize, typename WaitPolicy = SpinWait, std::size_t NodeStride = 1,
+              std::invocable CompletionFunction = NoCompletion, typename Stats = NoStats>
+    class TreeMultiDynamicBarrier : public TreeProtocol<TreeMultiDynamicBarrier<NodeSize, WaitPolicy, NodeStride,
+                                                                                CompletionFunction, Stats>,
+                                                        std::conditional_t<(NodeSize <= 8), uint16_t, uint32_t>,
+                                                        WaitPolicy, NodeStride, CompletionFunction, Stats, 6>
     {
         private:
-            enum class State : uint8_t
-            {
-                ENTERING = 0,
-                EXITING = 1,
-                STUCK = 2,
-            };
-            struct Payload
-            {
-                State state : 2;
-                uint8_t index : 6;
-                uint8_t threads : 4;
-                uint8_t waiting : 4;
+            // Nodes of up to 8 threads fit their counters in 4 bits each after the state and the 6 bits of the index,
+            // wider nodes need 12 bits each. Either way, the fields fill the whole payload, so no padding bits get in
+            // the way of CAS and waiting.
+            using Base = TreeProtocol<TreeMultiDynamicBarrier, std::conditional_t<(NodeSize <= 8), uint16_t, uint32_t>,
+                                      WaitPolicy, NodeStride, CompletionFunction, Stats, 6>;
+            friend Base;
+            using typename Base::State;
+            using typename Base::Payload;
+            using typename Base::Node;
+            using Base::TREE_ALIGNMENT;
+
+            static_assert(NodeSize >= 2 && NodeSize <= 64 && (NodeSize & (NodeSize - 1)) == 0,
+                          "Node size must be a power of 2 between 2 and 64");
+            // The shift amount for the node size
+            static constexpr uint32_t SHIFT_AMOUNT = std::countr_zero(NodeSize);
+
+            const uint8_t max_barriers;
 
-                Payload() : state(State::ENTERING), index(0), threads(0), waiting(0)
+            // The whole tree lives in one allocation, laid out level by level like an implicit heap: the root is at 0,
+            // the children of node i are at i * NodeSize + 1 to (i + 1) * NodeSize, and the parent of node i is at
+            // (i - 1) / NodeSize. The allocation is aligned to at least a cache line, so the layout is predictable.
+            // Created with SharedStorage, the tree goes right behind the barrier itself instead, and we only ever
+            // point at it with an offset, so the barrier works from any address the memory is mapped at (see
+            // Shared.hpp). The nodes themselves are payload_tree, in TreeProtocol, which also runs the whole node
+            // protocol.
+            void* allocation;                       // What we have to free, if we allocated it
+
+            static constexpr uint32_t TreeDepth(uint32_t max_threads)
+            {
+                // The smallest depth whose leaves can hold max_threads threads
+                uint32_t depth = 1;
+                uint64_t capacity = NodeSize;
+                while (capacity < max_threads)
                 {
+                    capacity <<= SHIFT_AMOUNT;
+                    depth++;
                 }
+                return depth;
+            }
 
-                Payload(uint8_t index, uint8_t threads, uint8_t waiting) : state(State::ENTERING), index(index),
-                        threads(threads), waiting(waiting)
+            // The size of the tree, rounded up so that futex words never spill past it
+            static constexpr std::size_t TreeSize(uint32_t max_threads)
+            {
+                // Every level has NodeSize times the nodes of the one above it
+                std::size_t total_nodes = 0;
+                std::size_t level_nodes = 1;
+                for (uint32_t i = 0; i < TreeDepth(max_threads); i++)
                 {
+                    total_nodes += level_nodes;
+                    level_nodes <<= SHIFT_AMOUNT;
                 }
-            };
+                return (total_nodes * sizeof(Node) + TREE_ALIGNMENT - 1) & ~(TREE_ALIGNMENT - 1);
+            }
 
-            const uint8_t max_barriers;
-            const uint32_t max_threads;
-            const uint32_t node_size;
-            const uint32_t tree_depth;
-            const uint32_t shift_amount;            // The shift amount for the node size
-            uint32_t leaf_nodes;
+            // Where the tree starts for a barrier created with SharedStorage
+            char* SharedAllocation()
+            {
+                uintptr_t end = reinterpret_cast<uintptr_t>(this) + sizeof(TreeMultiDynamicBarrier);
+                return reinterpret_cast<char*>((end + TREE_ALIGNMENT - 1) & ~uintptr_t(TREE_ALIGNMENT - 1));
+            }
 
-            std::mutex opt_in_mutex;
+            // Where TreeProtocol finds its way around the tree
+            uint32_t Leaf(uint32_t tid) const
+            {
+                return this->leaf_offset + (tid >> SHIFT_AMOUNT);
+            }
 
-            // Atomics are not copyable, so we need to use a pointer to an atomic
-            std::atomic<Payload>** payload_tree;
+            uint32_t Parent(uint32_t node) const
+            {
+                return (node - 1) >> SHIFT_AMOUNT;
+            }
 
-        public:
-            TreeMultiDynamicBarrier(uint8_t max_barriers, uint32_t node_size, uint32_t max_threads) :
-                               max_barriers(max_barriers), max_threads(max_threads), node_size(node_size),
-                               tree_depth(std::log(max_threads + 1) / std::log(node_size)),
-                               shift_amount(std::log2(node_size))
+            // Every node goes through the barriers in turn, and the index says which one it is at. Threads can only
+            // join a node while it is at the first one, so they always start a whole round. OptOut waits for it too,
+            // but ArriveAndOptOut and OptOut with a token leave in the middle of a round.
+            bool AtStart(const Payload& payload) const
             {
-                // Node size must be a power of 2
-                if ((node_size & (node_size - 1)) != 0)
-                {
-                    throw std::invalid_argument("Node size must be a power of 2");
-                }
-                // Until we template the payload, we need to make sure the node size is not too big
-                if (node_size > 8)
-                {
-                    throw std::invalid_argument("Node size must be less than or equal to 8");
-                }
-                // Allocate the tree
-                this->payload_tree = new std::atomic<Payload>*[this->tree_depth];
-                // Find how many nodes are in every level of the tree and allocate them
-                for (uint32_t i = 0; i < this->tree_depth; i++)
-                {
-                    uint32_t nodes = 1;
-                    for (uint32_t j = 0; j < i; j++)
-                    {
-                        nodes *= node_size;
-                    }
-                    this->leaf_nodes = nodes;           // Will keep getting updated until the last level
-                    this->payload_tree[i] = new std::atomic<Payload>[nodes];
-                    // Initialize every node in the level
-                    for (uint32_t j = 0; j < nodes; j++)
-                    {
-                        this->payload_tree[i][j].store(Payload(0, 0, 0));
-                    }
-                }
+                return payload.index == 0;
             }
 
-            TreeMultiDynamicBarrier(uint8_t max_barriers, uint32_t node_size, uint32_t max_threads,
-                                    uint32_t opted_in_threads) : max_barriers(max_barriers), max_threads(max_threads),
-                                    node_size(node_size), tree_depth(std::log(max_threads + 1) / std::log(node_size)),
-                                    shift_amount(std::log2(node_size))
+            // Once everyone left a node, it goes on to the next barrier. A node nobody is in anymore has no barrier
+            // to be at, so it starts over at the first one, for whoever opts in to it next.
+            void NextPhase(Payload& payload) const
             {
-                // Node size must be a power of 2
-                if ((node_size & (node_size - 1)) != 0)
+                payload.index++;
+                if (payload.index == this->max_barriers || payload.threads == 0)
                 {
-                    throw std::invalid_argument("Node size must be a power of 2");
+                    payload.index = 0;
                 }
-                // Until we template the payload, we need to make sure the node size is not too big
-                if (node_size > 8)
+            }
+
+            // Waits until our leaf is ENTERING at index, by only reading it. Until then, it is still EXITING the
+            // barrier before, and a CAS that cannot succeed would still take the line away from the threads leaving
+            // it. Once it is, nobody can move it on without us, so entering takes a single CAS.
+            void AwaitIndex(uint32_t tid, uint8_t index)
+            {
+                std::atomic<Payload>& node_payload = this->payload_tree[this->Leaf(tid)].payload;
+                Payload old_payload = node_payload.load();
+                while (old_payload.state != State::ENTERING || old_payload.index != index)
                 {
-                    throw std::invalid_argument("Node size must be less than or equal to 8");
+                    this->stats.Spin(tid);
+                    WaitPolicy::Wait(node_payload, old_payload);
+                    old_payload = node_payload.load();
                 }
-                // Allocate the tree
-                this->payload_tree = new std::atomic<Payload>*[this->tree_depth];
-                // Find how many nodes are in every level of the tree and allocate them
+            }
+
+            // Lays out the tree in storage, or in an allocation of its own if there is none
+            TreeMultiDynamicBarrier(char* storage, uint8_t max_barriers, uint32_t max_threads,
+                                    uint32_t opted_in_threads, CompletionFunction completion) :
+                                    Base(max_threads, std::move(completion)), max_barriers(max_barriers)
+            {
+                this->tree_depth = TreeDepth(max_threads);
+                // Find how many nodes are in the tree, every level has NodeSize times the nodes of the one above it
+                uint32_t total_nodes = 0;
+                this->leaf_nodes = 1;
                 for (uint32_t i = 0; i < this->tree_depth; i++)
                 {
-                    uint32_t nodes = 1;
-                    for (uint32_t j = 0; j < i; j++)
+                    this->leaf_offset = total_nodes;    // Will keep getting updated until the last level
+                    total_nodes += this->leaf_nodes;
+                    if (i != this->tree_depth - 1)
                     {
-                        nodes *= node_size;
-                    }
-                    this->leaf_nodes = nodes;           // Will keep getting updated until the last level
-                    this->payload_tree[i] = new std::atomic<Payload>[nodes];
-                    // Initialize every node in the level
-                    for (uint32_t j = 0; j < nodes; j++)
-                    {
-                        this->payload_tree[i][j].store(Payload(0, 0, 0));
+                        this->leaf_nodes <<= SHIFT_AMOUNT;
                     }
                 }
-                // Opt in the specified number of threads
-                for (uint32_t i = 0; i < opted_in_threads; i++)
+                // Allocate and initialize the whole tree at once
+                this->allocation = nullptr;
+                if (storage == nullptr)
                 {
-                    this->OptIn(i);
+                    this->allocation = ::operator new[](TreeSize(max_threads), std::align_val_t(TREE_ALIGNMENT));
+                    storage = static_cast<char*>(this->allocation);
                 }
+                this->payload_tree = reinterpret_cast<Node*>(storage);
+                for (uint32_t i = 0; i < total_nodes; i++)
+                {
+                    new (&this->payload_tree[i]) Node();
+                    this->payload_tree[i].payload.store(Payload(0, 0));
+                }
+                // Opt in the specified number of threads
+                this->OptInRange(0, opted_in_threads);
             }
 
-            ~TreeMultiDynamicBarrier()
+        public:
+            TreeMultiDynamicBarrier(uint8_t max_barriers, uint32_t max_threads) :
+                                    TreeMultiDynamicBarrier(max_barriers, max_threads, 0)
             {
-                for (int32_t i = this->tree_depth - 1; i >= 0; i--)
-                {
-                    delete[] this->payload_tree[i];
-                }
-                delete[] this->payload_tree;
             }
 
-            void OptIn(uint32_t tid)
+            TreeMultiDynamicBarrier(uint8_t max_barriers, uint32_t max_threads, uint32_t opted_in_threads,
+                                    CompletionFunction completion = CompletionFunction()) :
+                                    TreeMultiDynamicBarrier(nullptr, max_barriers, max_threads, opted_in_threads,
+                                                            std::move(completion))
             {
-                // Can only increment if the barrier is NOT in use (i.e., waiting == 0, index == 0 and state is ENTERING).
-                // The problem is, the barrier is no longer one unit, and while we can be sure that a leaf node is not
-                // in use, we cannot be sure that the parent node is not in use. Doing it step by step exposes us to races
-                // if/when multiple threads try to opt in in the same node.
-                // To do it all at once, we will use a mutex (opting in is much less frequent than arriving, so I will
-                // bite the bullet). We will lock the whole thing, preventing other threads from opting in, then do the
-                // opt in step by step
-                this->opt_in_mutex.lock();
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
-                while (level >= 0)
-                {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    old_payload.waiting = 0;
-                    old_payload.index = 0;
-                    old_payload.state = State::ENTERING;
-                    Payload new_payload = old_payload;
-                    new_payload.threads++;
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                    {
-                        old_payload.waiting = 0;
-                        old_payload.index = 0;
-                        old_payload.state = State::ENTERING;
-                        new_payload = old_payload;
-                        new_payload.threads++;
-                    }
-                    if (old_payload.threads != 0)
-                    {
-                        break;
-                    }
-                    // We were at 0, must increment parent
-                    level--;
-                    node >>= this->shift_amount;
-                }
-                this->opt_in_mutex.unlock();
             }
 
-            void OptOut(uint32_t tid)
+            // Builds the barrier with its tree right behind itself, where there must be room for SharedSize bytes
+            // from the barrier on, so it can be placed in memory shared between processes. Use CreateShared (see
+            // Shared.hpp) rather than calling this directly.
+            TreeMultiDynamicBarrier(SharedStorage, uint8_t max_barriers, uint32_t max_threads,
+                                    uint32_t opted_in_threads = 0,
+                                    CompletionFunction completion = CompletionFunction()) :
+                                    TreeMultiDynamicBarrier(this->SharedAllocation(), max_barriers, max_threads,
+                                                            opted_in_threads, std::move(completion))
             {
-                // To avoid deadlocks, decrementing threads can happen at any time the state is ENTERING, as long as
-                // waiting is less than threads and index is 0.
-                // To elaborate on deadlocks, imaging the following scenario:
-                // 1. Thread 1 enters.
-                // 2. Thread 2 tries to decrement, has to wait for all to exit barrier.
-                // 3. Thread 1 will never exit barrier because it is waiting for thread 2 to enter.
-                // 4. Deadlock.
+            }
 
-                // We do the following:
-                // 1. Find the leaf node we are at.
-                // 2. If the state is EXITING, wait for it to become ENTERING.
-                // 3. If the state is ENTERING, decrement the threads.
-                // 4. If after decrementing, waiting is equal to threads, set state to EXITING.
-                // 5. If after decrementing, number of threads is 0, also decrement the parent node. Repeat if needed
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
+            // How many bytes a barrier created with SharedStorage takes, with the same arguments as its constructor
+            template <typename... Rest>
+            static constexpr std::size_t SharedSize(uint8_t max_barriers, uint32_t max_threads, const Rest&...)
+            {
+                return sizeof(TreeMultiDynamicBarrier) + TREE_ALIGNMENT + TreeSize(max_threads);
+            }
 
-                while (level >= 0)
+            ~TreeMultiDynamicBarrier()
+            {
+                // Nodes are trivially destructible, so we can just free the tree
+                if (this->allocation != nullptr)
                 {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING ||
-                           old_payload.index != 0)
-                    {
-                        old_payload = node_payload.load();
-                    }
-                    Payload new_payload = old_payload;
-                    new_payload.threads--;
-                    if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
-                    {
-                        if (level == 0)
-                        {
-                            // If after decrementing the last level, waiting is equal to threads, set state to EXITING.
-                            new_payload.state = State::EXITING;
-                        }
-                        else
-                        {
-                            // However, if after decrementing other levels, waiting is equal to threads, the waiters
-                            // may be stuck since noone from the upper levels would return to them.
-                            new_payload.state = State::STUCK;
-                        }
-                    }
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                    {
-                        while (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING ||
-                               old_payload.index != 0)
-                        {
-                            old_payload = node_payload.load();
-                        }
-                        new_payload = old_payload;
-                        new_payload.threads--;
-                        if (new_payload.waiting == new_payload.threads && new_payload.threads != 0)
-                        {
-                            if (level == 0)
-                            {
-                                // If after decrementing the last level, waiting is equal to threads, set state to EXITING.
-                                new_payload.state = State::EXITING;
-                            }
-                            else
-                            {
-                                // However, if after decrementing other levels, waiting is equal to threads, the waiters
-                                // may be stuck since noone from the upper levels would return to them.
-                                new_payload.state = State::STUCK;
-                            }
-                        }
-                    }
-                    // Decrement parent if needed
-                    if (new_payload.threads == 0 && level > 0)
-                    {
-                        level--;
-                        node >>= this->shift_amount;
-                    }
-                    else
-                    {
-                        break;
-                    }
+                    ::operator delete[](this->allocation, std::align_val_t(TREE_ALIGNMENT));
                 }
             }
 
+            using typename Base::Token;
+
+            TreeMultiDynamicBarrier(const TreeMultiDynamicBarrier&) = delete;
+            TreeMultiDynamicBarrier& operator=(const TreeMultiDynamicBarrier&) = delete;
+
+            // Every thread goes through the barriers in turn: it arrives at index 0, then 1, and so on up to
+            // max_barriers - 1, and then starts over at 0. OptIn and OptOut wait for a round to be over, while
+            // ArriveAndOptOut and OptOut with a token leave in the middle of one, since nobody waits for them there.
             void Arrive(uint32_t tid, uint8_t index)
             {
-                // We know the thread id, so we directly know the leaf node we should barrier at
-                uint32_t node = tid >> this->shift_amount;
-                int32_t level = this->tree_depth - 1;
-                // From here, we can loop going up doing the following at every level:
-                // 1. Enter the barrier, barrier must be in ENTERING state and index must match.
-                // 2. If we are NOT the last to enter, wait for state to become EXITING.
-                // 3. If we are the last to enter, traverse up the tree and repeat.
-                // 4. If we are at the root level, and this is NOT the last thread to enter, wait for state to change to EXITING.
-                // 5. If we are at the root level, and this is the last thread to enter, set state to EXITING.
-                // 6. Traverse down the tree, setting state to EXITING at every level.
-
-                while (level >= 0)
-                {
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    // Step 1
-                    Payload old_payload = node_payload.load();
-                    old_payload.state = State::ENTERING;
-                    old_payload.index = index;
-                    Payload new_payload = old_payload;
-                    new_payload.waiting++;
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                    {
-                        old_payload.state = State::ENTERING;
-                        old_payload.index = index;
-                        new_payload = old_payload;
-                        new_payload.waiting++;
-                    }
+                this->AwaitIndex(tid, index);
+                Base::Arrive(tid);
+            }
 
-                    if (new_payload.waiting != new_payload.threads)
-                    {
-                        // Step 2 and 4
-                        while (true)
-                        {
-                            auto temp_payload = node_payload.load();
-                            if (temp_payload.state == State::ENTERING)
-                            {
-                                continue;
-                            }
-                            else if (temp_payload.state == State::EXITING)
-                            {
-                                break;
-                            }
-                            else
-                            {
-                                // State is STUCK. Pick one thread to continue to next levels, change state to entering
-                                if (temp_payload.waiting == temp_payload.threads)
-                                {
-                                    temp_payload.state = State::ENTERING;
-                                    node_payload.store(temp_payload);
-                                    goto correction;
-                                }
-                                else
-                                {
-                                    continue;
-                                }
-                            }
-                        }
-                        old_payload = node_payload.load();
-                        new_payload = old_payload;
-                        new_payload.waiting--;
-                        // If we are last to exit, set state to ENTERING and increment the index.
-                        if (new_payload.waiting == 0)
-                        {
-                            new_payload.state = State::ENTERING;
-                            new_payload.index++;
-                            if (new_payload.index == this->max_barriers)
-                            {
-                                new_payload.index = 0;
-                            }
-                        }
-                        while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                        {
-                            new_payload = old_payload;
-                            new_payload.waiting--;
-                            if (new_payload.waiting == 0)
-                            {
-                                new_payload.state = State::ENTERING;
-                                new_payload.index++;
-                                if (new_payload.index == this->max_barriers)
-                                {
-                                    new_payload.index = 0;
-                                }
-                            }
-                        }
-                        break;
-                    }
-                    else
-                    {
-correction:
-                        if (level == 0)
-                        {
-                            // Step 5
-                            old_payload = node_payload.load();
-                            new_payload = old_payload;
-                            new_payload.state = State::EXITING;
-                            new_payload.waiting--;
-                            // If we are last to exit, set state to ENTERING. (Happens if we are the only thread)
-                            if (new_payload.waiting == 0)
-                            {
-                                new_payload.state = State::ENTERING;
-                                new_payload.index++;
-                                if (new_payload.index == this->max_barriers)
-                                {
-                                    new_payload.index = 0;
-                                }
-                            }
-                            while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                            {
-                                new_payload = old_payload;
-                                new_payload.state = State::EXITING;
-                                new_payload.waiting--;
-                                if (new_payload.waiting == 0)
-                                {
-                                    new_payload.state = State::ENTERING;
-                                    new_payload.index++;
-                                    if (new_payload.index == this->max_barriers)
-                                    {
-                                        new_payload.index = 0;
-                                    }
-                                }
-                            }
-                            break;
-                        }
-                        else
-                        {
-                            // Step 3
-                            level--;
-                            node >>= this->shift_amount;
-                        }
-                    }
-                }
+            // The first half of Arrive, see TreeProtocol. Pass the token to Wait, TryWait or OptOut, like there.
+            Token ArriveNoWait(uint32_t tid, uint8_t index)
+            {
+                this->AwaitIndex(tid, index);
+                return Base::ArriveNoWait(tid);
+            }
 
-                // Step 6
-                while (level < (int32_t)this->tree_depth - 1)
+            // Arrives at barrier index, but only waits until deadline, see TreeProtocol. If our leaf did not even come
+            // around to index by then, we never arrived, and return false right away.
+            template <typename Clock, typename Duration>
+            bool TryArriveUntil(uint32_t tid, uint8_t index, const std::chrono::time_point<Clock, Duration>& deadline)
+            {
+                std::atomic<Payload>& node_payload = this->payload_tree[this->Leaf(tid)].payload;
+                Payload old_payload = node_payload.load();
+                while (old_payload.state != State::ENTERING || old_payload.index != index)
                 {
-                    level++;
-                    node = tid >> (this->shift_amount * (this->tree_depth - level));
-                    std::atomic<Payload>& node_payload = this->payload_tree[level][node];
-                    Payload old_payload = node_payload.load();
-                    Payload new_payload = old_payload;
-                    new_payload.state = State::EXITING;
-                    new_payload.waiting--;
-                    // If we are last to exit, set state to ENTERING.
-                    if (new_payload.waiting == 0)
+                    if (Clock::now() >= deadline)
                     {
-                        new_payload.state = State::ENTERING;
-                        new_payload.index++;
-                        if (new_payload.index == this->max_barriers)
-                        {
-                            new_payload.index = 0;
-                        }
-                    }
-                    while (!node_payload.compare_exchange_weak(old_payload, new_payload))
-                    {
-                        new_payload = old_payload;
-                        new_payload.state = State::EXITING;
-                        new_payload.waiting--;
-                        if (new_payload.waiting == 0)
-                        {
-                            new_payload.state = State::ENTERING;
-                            new_payload.index++;
-                            if (new_payload.index == this->max_barriers)
-                            {
-                                new_payload.index = 0;
-                            }
-                        }
+                        return false;
                     }
+                    this->stats.Spin(tid);
+                    WaitPolicy::Poll(node_payload, old_payload);
+                    old_payload = node_payload.load();
                 }
+                return Base::TryArriveUntil(tid, deadline);
             }
 
-            uint32_t GetMaxThreads() const
+            template <typename Rep, typename Period>
+            bool TryArriveFor(uint32_t tid, uint8_t index, const std::chrono::duration<Rep, Period>& timeout)
             {
-                return this->max_threads;
+                return this->TryArriveUntil(tid, index, std::chrono::steady_clock::now() + timeout);
             }
 
-            uint32_t GetNodeSize() const
+            // Arrives at barrier index and opts us out without waiting, see TreeProtocol
+            void ArriveAndOptOut(uint32_t tid, uint8_t index)
             {
-                return this->node_size;
+                this->AwaitIndex(tid, index);
+                Base::ArriveAndOptOut(tid);
             }
 
-            uint32_t GetOptedInThreads() const
-            {
-                // Total number of threads of every node in the leafs
-                uint32_t total_threads = 0;
-                for (uint32_t i = 0; i < this->leaf_nodes; i++)
-                {
-                    total_threads += this->payload_tree[this->tree_depth - 1][i].load().threads;
-                }
-                return total_threads;
-            }
-
-            uint32_t GetWaitingThreads() const
+            uint32_t GetNodeSize() const
             {
-                // Total number of waiting threads of every node in the leafs
-                uint32_t total_threads = 0;
-                for (uint32_t i = 0; i < this->leaf_nodes; i++)
-                {
-                    total_threads += this->payload_tree[this->tree_depth - 1][i].load().waiting;
-                }
-                return total_threads;
+                return NodeSize;
             }
     };
 }
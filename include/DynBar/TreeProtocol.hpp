@@ -0,0 +1,909 @@
+#ifndef __DYNBAR_TREEPROTOCOL_HPP__
+#define __DYNBAR_TREEPROTOCOL_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <map>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "DynBar/Completion.hpp"
+#include "DynBar/Shared.hpp"
+#include "DynBar/Stats.hpp"
+#include "DynBar/WaitPolicy.hpp"
+
+namespace DYNBAR
+{
+    // What every node of TreeDynamicBarrier, TreeMultiDynamicBarrier and TopologyDynamicBarrier goes through: opting in
+    // and out, arriving, waiting, taking STUCK nodes up the tree, split phase and timed arrival. They mostly differ in
+    // how the tree is laid out, so they derive from this and tell it where things are with two hooks:
+    // - Leaf(tid): the leaf tid barriers at.
+    // - Parent(node): the parent of a node that is not the root. The root is always node 0, and every node must have
+    //   a larger index than its parent.
+    // The derived barrier allocates the nodes, and sets tree_depth, leaf_nodes and leaf_offset before opting anyone in.
+    // Storage is the integer the payload of a node packs into. Its counters get whatever bits the state leaves, and
+    // the index, if IndexBits is not 0. Only TreeMultiDynamicBarrier has an index, and it hides two more hooks (see
+    // AtStart and NextPhase below) to go through its barriers in turn.
+    template <typename Derived, typename Storage, typename WaitPolicy, std::size_t NodeStride,
+              std::invocable CompletionFunction, typename Stats, uint32_t IndexBits = 0>
+    class TreeProtocol
+    {
+        protected:
+            enum class State : uint8_t
+            {
+                ENTERING = 0,
+                EXITING = 1,
+                STUCK = 2,
+                JOINING = 3,
+            };
+            static constexpr uint32_t COUNT_BITS = (sizeof(Storage) * 8 - 2 - IndexBits) / 2;
+            struct PlainPayload
+            {
+                State state : 2;
+                Storage threads : COUNT_BITS;
+                Storage waiting : COUNT_BITS;
+
+                PlainPayload() : state(State::ENTERING), threads(0), waiting(0)
+                {
+                }
+
+                PlainPayload(Storage threads, Storage waiting) : state(State::ENTERING), threads(threads),
+                             waiting(waiting)
+                {
+                }
+            };
+            // A bit-field cannot have 0 bits, so the index gets a payload of its own
+            struct IndexedPayload
+            {
+                State state : 2;
+                Storage index : IndexBits;
+                Storage threads : COUNT_BITS;
+                Storage waiting : COUNT_BITS;
+
+                IndexedPayload() : state(State::ENTERING), index(0), threads(0), waiting(0)
+                {
+                }
+
+                IndexedPayload(Storage threads, Storage waiting) : state(State::ENTERING), index(0), threads(threads),
+                               waiting(waiting)
+                {
+                }
+            };
+            using Payload = std::conditional_t<IndexBits == 0, PlainPayload, IndexedPayload>;
+            static_assert(sizeof(Payload) == sizeof(Storage));
+
+            // Every node takes at least NodeStride bytes. With the default of 1, nodes are packed next to each other
+            // and a whole level can share a cache line. Set it to the cache line size (or twice that, to also defeat
+            // the adjacent line prefetcher) to give every node its own line.
+            static_assert((NodeStride & (NodeStride - 1)) == 0, "Node stride must be a power of 2");
+            struct alignas(NodeStride) alignas(std::atomic<Payload>) Node
+            {
+                std::atomic<Payload> payload;
+            };
+            static constexpr std::size_t TREE_ALIGNMENT = alignof(Node) > 64 ? alignof(Node) : 64;
+
+            const uint32_t max_threads;
+            uint32_t tree_depth;
+            uint32_t leaf_nodes;
+            uint32_t leaf_offset;                   // The index of the first leaf in the tree
+            OffsetPtr<Node> payload_tree;
+
+            [[no_unique_address]] CompletionFunction completion;
+            [[no_unique_address]] Stats stats;
+
+            TreeProtocol(uint32_t max_threads, CompletionFunction completion) : max_threads(max_threads),
+                         tree_depth(0), leaf_nodes(0), leaf_offset(0), completion(std::move(completion)),
+                         stats(max_threads)
+            {
+            }
+
+            uint32_t Leaf(uint32_t tid) const
+            {
+                return static_cast<const Derived*>(this)->Leaf(tid);
+            }
+
+            uint32_t Parent(uint32_t node) const
+            {
+                return static_cast<const Derived*>(this)->Parent(node);
+            }
+
+            // Whether threads can join or leave a node at the phase it is at. TreeMultiDynamicBarrier only lets them
+            // in or out at the start of its barriers, the other trees have nothing to wait for.
+            bool AtStart(const Payload&) const
+            {
+                return true;
+            }
+
+            // What a node goes on to once the last thread left its phase, or once it has no threads left at all.
+            // TreeMultiDynamicBarrier moves it on to its next barrier, or back to its first one if it is empty.
+            void NextPhase(Payload&) const
+            {
+            }
+
+            // Whether threads cannot join a node right now: it has threads waiting, is not ENTERING, or not AtStart
+            bool InUse(const Payload& payload) const
+            {
+                return payload.waiting != 0 || payload.state != State::ENTERING ||
+                       !static_cast<const Derived*>(this)->AtStart(payload);
+            }
+
+            // Sets a node the last thread just left back to ENTERING, at its next phase
+            void Reopen(Payload& payload) const
+            {
+                payload.state = State::ENTERING;
+                static_cast<const Derived*>(this)->NextPhase(payload);
+            }
+
+            // A CAS that tells the stats when it has to be retried
+            bool CompareExchange(uint32_t tid, std::atomic<Payload>& node_payload, Payload& old_payload,
+                                 Payload new_payload)
+            {
+                if (node_payload.compare_exchange_weak(old_payload, new_payload))
+                {
+                    return true;
+                }
+                this->stats.CasFailure(tid);
+                return false;
+            }
+
+            // Adds count threads to a node, if it is NOT in use (see InUse). Returns false without waiting if it is,
+            // otherwise returns true and how many threads the node had before. A node that had none is not counted
+            // in its parent yet, so it is left JOINING, and the caller must Join it once it is counted all the way up.
+            bool TryAddThreads(uint32_t tid, std::atomic<Payload>& node_payload, uint32_t count, uint32_t& old_threads)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload;
+                do
+                {
+                    if (this->InUse(old_payload))
+                    {
+                        return false;
+                    }
+                    new_payload = old_payload;
+                    new_payload.threads += count;
+                    if (old_payload.threads == 0)
+                    {
+                        new_payload.state = State::JOINING;
+                    }
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload));
+                old_threads = old_payload.threads;
+                return true;
+            }
+
+            // Lets everyone else into a node we left JOINING.
+            void Join(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload;
+                do
+                {
+                    new_payload = old_payload;
+                    new_payload.state = State::ENTERING;
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload));
+                WaitPolicy::Notify(node_payload);
+            }
+
+            void WaitUntilFree(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                while (this->InUse(old_payload))
+                {
+                    this->stats.Spin(tid);
+                    WaitPolicy::Wait(node_payload, old_payload);
+                    old_payload = node_payload.load();
+                }
+            }
+
+            // Removes count threads from a node, and returns how many are left. If the threads left are all waiting,
+            // the node is done with this phase, and is STUCK until one of its waiters takes it up the tree. That
+            // includes the root: only the waiters can combine what ArriveAndReduce left in it, so one of them
+            // completes the phase just like the last thread to arrive would. Unless the node is AtStart, it waits
+            // until it is.
+            // If wait is false, the threads removed must be ones that have not arrived in this phase, so the node
+            // cannot be done with it, and there is nothing to wait for. If it is still EXITING the previous phase,
+            // the threads that are left are still counted and drain it as usual.
+            uint32_t RemoveThreads(uint32_t tid, std::atomic<Payload>& node_payload, uint32_t count, bool wait = true)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload;
+                do
+                {
+                    while (wait && (old_payload.waiting == old_payload.threads || old_payload.state == State::EXITING ||
+                                    !static_cast<const Derived*>(this)->AtStart(old_payload)))
+                    {
+                        this->stats.Spin(tid);
+                        WaitPolicy::Wait(node_payload, old_payload);
+                        old_payload = node_payload.load();
+                    }
+                    new_payload = old_payload;
+                    new_payload.threads -= count;
+                    if (new_payload.state != State::EXITING && new_payload.waiting == new_payload.threads &&
+                        new_payload.threads != 0)
+                    {
+                        // If after decrementing, waiting is equal to threads, the waiters may be stuck since noone
+                        // from the upper levels would return to them.
+                        new_payload.state = State::STUCK;
+                    }
+                    if (new_payload.threads == 0)
+                    {
+                        // Whoever opts in to it next starts from scratch
+                        static_cast<const Derived*>(this)->NextPhase(new_payload);
+                    }
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload));
+                if (new_payload.state == State::STUCK)
+                {
+                    // The threads waiting in this node must correct it, wake them up.
+                    WaitPolicy::Notify(node_payload);
+                }
+                return new_payload.threads;
+            }
+
+            // Removes count threads from a node, and the node from its parent if it has none left. Repeat if needed.
+            void Leave(uint32_t tid, uint32_t node, uint32_t count, bool wait = true)
+            {
+                while (this->RemoveThreads(tid, this->payload_tree[node].payload, count, wait) == 0 && node != 0)
+                {
+                    node = this->Parent(node);
+                    count = 1;
+                }
+            }
+
+            // Pending changes to the threads of every node, to begin with how many of [first_tid, last_tid) every
+            // leaf has. Every node has a larger index than its parent, so taking the largest one first handles every
+            // node after all of its children, and every parent gets what they all passed up at once.
+            std::map<uint32_t, uint32_t> LeafCounts(uint32_t first_tid, uint32_t last_tid) const
+            {
+                std::map<uint32_t, uint32_t> counts;
+                // Neighbouring tids mostly share a leaf, so we only go to the map once for every run of them
+                uint32_t leaf = this->Leaf(first_tid);
+                uint32_t count = 0;
+                for (uint32_t tid = first_tid; tid < last_tid; tid++)
+                {
+                    if (this->Leaf(tid) != leaf)
+                    {
+                        counts[leaf] += count;
+                        leaf = this->Leaf(tid);
+                        count = 0;
+                    }
+                    count++;
+                }
+                counts[leaf] += count;
+                return counts;
+            }
+
+            // What plain Arrive carries up the tree: nothing. All of it compiles away.
+            struct NoReduction
+            {
+                void Deposit(uint32_t, const uint32_t*, int32_t)
+                {
+                }
+
+                void Combine(uint32_t)
+                {
+                }
+
+                void Publish()
+                {
+                }
+            };
+
+            // Fills path with the nodes from our leaf (at level tree_depth - 1) up to the root (at level 0)
+            void Path(uint32_t tid, uint32_t* path) const
+            {
+                // We know the thread id, so we directly know the leaf node we should barrier at
+                uint32_t node = this->Leaf(tid);
+                for (int32_t level = this->tree_depth - 1; level > 0; level--)
+                {
+                    path[level] = node;
+                    node = this->Parent(node);
+                }
+                path[0] = node;
+            }
+
+            // Step 1. Enters a node, which must be in ENTERING state, and returns whether we were the last to enter.
+            bool Enter(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                old_payload.state = State::ENTERING;
+                Payload new_payload = old_payload;
+                new_payload.waiting++;
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload))
+                {
+                    // If the node is still exiting the previous phase (or being corrected), wait for it.
+                    while (old_payload.state != State::ENTERING)
+                    {
+                        this->stats.Spin(tid);
+                        WaitPolicy::Wait(node_payload, old_payload);
+                        old_payload = node_payload.load();
+                    }
+                    old_payload.state = State::ENTERING;
+                    new_payload = old_payload;
+                    new_payload.waiting++;
+                }
+                return new_payload.waiting == new_payload.threads;
+            }
+
+            // Steps 5 and 6. Sets a node we took up the tree to EXITING, and leaves it.
+            void Release(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload = old_payload;
+                new_payload.state = State::EXITING;
+                new_payload.waiting--;
+                // If we are last to exit, set state to ENTERING. (Happens if we were alone in it)
+                if (new_payload.waiting == 0)
+                {
+                    this->Reopen(new_payload);
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload))
+                {
+                    new_payload = old_payload;
+                    new_payload.state = State::EXITING;
+                    new_payload.waiting--;
+                    if (new_payload.waiting == 0)
+                    {
+                        this->Reopen(new_payload);
+                    }
+                }
+                // Either release the waiters, or the node itself if we were alone in it.
+                WaitPolicy::Notify(node_payload);
+            }
+
+            // Leaves a node that was released while we waited in it.
+            void Exit(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload = old_payload;
+                new_payload.waiting--;
+                // If we are last to exit, set state to ENTERING.
+                if (new_payload.waiting == 0)
+                {
+                    this->Reopen(new_payload);
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload))
+                {
+                    new_payload = old_payload;
+                    new_payload.waiting--;
+                    if (new_payload.waiting == 0)
+                    {
+                        this->Reopen(new_payload);
+                    }
+                }
+                if (new_payload.waiting == 0)
+                {
+                    // We were last to exit, wake up everyone waiting for the node to be released.
+                    WaitPolicy::Notify(node_payload);
+                }
+            }
+
+            // Step 6. Releases the nodes below level that we took up the tree.
+            void Descend(uint32_t tid, const uint32_t* path, int32_t level)
+            {
+                while (level < (int32_t)this->tree_depth - 1)
+                {
+                    level++;
+                    this->Release(tid, this->payload_tree[path[level]].payload);
+                }
+            }
+
+            // Step 3. Climbs from path[level] for as long as we are the last to enter. If entered is true, we already
+            // are the last one in path[level] (we won its correction). Returns the level we have to wait at, or -1 if
+            // we got through the root and released everything on our way back down.
+            template <typename Reducer>
+            int32_t Climb(uint32_t tid, const uint32_t* path, int32_t level, bool entered, Reducer& reduction)
+            {
+                while (true)
+                {
+                    std::atomic<Payload>& node_payload = this->payload_tree[path[level]].payload;
+                    if (!entered)
+                    {
+                        // Our value must be in before we count as arrived, whoever takes the node up relies on it
+                        reduction.Deposit(tid, path, level);
+                        if (!this->Enter(tid, node_payload))
+                        {
+                            return level;
+                        }
+                    }
+                    entered = false;
+                    // Everyone in this node arrived, so all their values are in
+                    reduction.Combine(path[level]);
+                    if (level == 0)
+                    {
+                        // Step 5. Everyone is waiting for us, and nobody can change the root until we set it to
+                        // EXITING, so this is where the result is published and the completion function runs.
+                        reduction.Publish();
+                        this->stats.LastArriver(tid);
+                        this->completion();
+                        this->Release(tid, node_payload);
+                        this->Descend(tid, path, 0);
+                        return -1;
+                    }
+                    level--;
+                }
+            }
+
+            // Steps 2 and 4. Waits in path[level] until it is released, then leaves it and releases the nodes below
+            // it that we took up the tree. If the node gets STUCK instead, one of its waiters takes it up the tree,
+            // and then waits wherever it has to next. Returns -1 once we are out. Unless block is true, it returns the
+            // level we still have to wait at instead of waiting.
+            template <typename Reducer>
+            int32_t Await(uint32_t tid, const uint32_t* path, int32_t level, bool block, Reducer& reduction)
+            {
+                while (level >= 0)
+                {
+                    std::atomic<Payload>& node_payload = this->payload_tree[path[level]].payload;
+                    Payload temp_payload = node_payload.load();
+                    if (temp_payload.state == State::EXITING)
+                    {
+                        this->Exit(tid, node_payload);
+                        this->Descend(tid, path, level);
+                        return -1;
+                    }
+                    if (temp_payload.state == State::STUCK && temp_payload.waiting == temp_payload.threads)
+                    {
+                        // Pick one thread to continue to next levels, change state to entering. Only one of the
+                        // waiters may win the correction, the rest keep waiting.
+                        Payload corrected_payload = temp_payload;
+                        corrected_payload.state = State::ENTERING;
+                        if (node_payload.compare_exchange_strong(temp_payload, corrected_payload))
+                        {
+                            this->stats.StuckCorrection(tid);
+                            WaitPolicy::Notify(node_payload);
+                            level = this->Climb(tid, path, level, true, reduction);
+                        }
+                        continue;
+                    }
+                    if (!block)
+                    {
+                        return level;
+                    }
+                    this->stats.Spin(tid);
+                    WaitPolicy::Wait(node_payload, temp_payload);
+                }
+                return -1;
+            }
+
+            // Takes back our arrival, if nobody took it further up than path[level], where we wait. That node must
+            // not be done with the phase, and then the nodes below it that we took up the tree are only full because
+            // of us. Nobody else can change them, so we just take one waiter out of each. Returns false if the node
+            // is done (or being corrected), in which case our arrival is on its way up and we have to keep waiting.
+            bool Withdraw(uint32_t tid, const uint32_t* path, int32_t level)
+            {
+                std::atomic<Payload>& node_payload = this->payload_tree[path[level]].payload;
+                Payload old_payload = node_payload.load();
+                Payload new_payload;
+                do
+                {
+                    if (old_payload.state != State::ENTERING || old_payload.waiting == old_payload.threads)
+                    {
+                        return false;
+                    }
+                    new_payload = old_payload;
+                    new_payload.waiting--;
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload));
+                while (true)
+                {
+                    if (new_payload.waiting == 0)
+                    {
+                        // OptIn may be waiting for the node to be free.
+                        WaitPolicy::Notify(this->payload_tree[path[level]].payload);
+                    }
+                    if (++level == (int32_t)this->tree_depth)
+                    {
+                        return true;
+                    }
+                    std::atomic<Payload>& below_payload = this->payload_tree[path[level]].payload;
+                    old_payload = below_payload.load();
+                    do
+                    {
+                        new_payload = old_payload;
+                        new_payload.waiting--;
+                    }
+                    while (!this->CompareExchange(tid, below_payload, old_payload, new_payload));
+                }
+            }
+
+            // Takes us out of both the threads and waiting of the leaf we wait in, as long as it is ENTERING. Whether
+            // or not someone took the leaf up the tree already, that leaves it just as far from done as before. Either
+            // way, another thread of the leaf is still in it, so it never drops to 0 threads. Returns false if the leaf
+            // is not ENTERING (anymore).
+            bool Drop(uint32_t tid, std::atomic<Payload>& node_payload)
+            {
+                Payload old_payload = node_payload.load();
+                Payload new_payload;
+                do
+                {
+                    if (old_payload.state != State::ENTERING)
+                    {
+                        return false;
+                    }
+                    new_payload = old_payload;
+                    new_payload.threads--;
+                    new_payload.waiting--;
+                }
+                while (!this->CompareExchange(tid, node_payload, old_payload, new_payload));
+                if (new_payload.waiting == 0)
+                {
+                    // OptIn may be waiting for the node to be free.
+                    WaitPolicy::Notify(node_payload);
+                }
+                return true;
+            }
+
+            // Every arrival goes through here. The reduction deposits our value in every node we get to, combines a
+            // node's values if we take it up the tree, and publishes the result at the root.
+            template <typename Reducer>
+            void Arrive(uint32_t tid, const uint32_t* path, Reducer& reduction)
+            {
+                // We loop going up doing the following at every level:
+                // 1. Enter the barrier, barrier must be in ENTERING state.
+                // 2. If we are NOT the last to enter, wait for state to become EXITING.
+                // 3. If we are the last to enter, traverse up the tree and repeat.
+                // 4. If we are at the root level, and this is NOT the last thread to enter, wait for state to change
+                //    to EXITING.
+                // 5. If we are at the root level, and this is the last thread to enter, set state to EXITING.
+                // 6. Traverse down the tree, setting state to EXITING at every level.
+                this->stats.Arrived(tid);
+                int32_t level = this->Climb(tid, path, this->tree_depth - 1, false, reduction);
+                this->Await(tid, path, level, true, reduction);
+                this->stats.Released(tid);
+            }
+
+            template <typename Reducer>
+            void Arrive(uint32_t tid, Reducer& reduction)
+            {
+                uint32_t path[32];
+                this->Path(tid, path);
+                this->Arrive(tid, path, reduction);
+            }
+
+        public:
+            // What ArriveNoWait hands back: where we stopped on the way up, so that Wait can go on from there.
+            class Token
+            {
+                friend class TreeProtocol;
+                int32_t level;
+
+                explicit Token(int32_t level) : level(level)
+                {
+                }
+            };
+
+            void OptIn(uint32_t tid)
+            {
+                // Can only increment a node if it is NOT in use (i.e., waiting == 0 and state is ENTERING).
+                // The barrier is no longer one unit, so we go up step by step, and only take the next step if we moved
+                // a node from 0 to 1 threads. There is no need to lock the whole way up:
+                // - Only one thread can move a node from 0 to 1, so every node is added to its parent exactly once.
+                // - Until we are done, the nodes we moved from 0 are not counted all the way up. They stay JOINING
+                //   until then, so nobody else can opt in to them. Otherwise, a thread could opt in next to us and
+                //   arrive, and the rest of the tree would go on without waiting for it.
+                // - A node can only drop back to 0 once all of its threads opted out, and we cannot opt out before we
+                //   are done here, so the parent never loses a node it was not given yet.
+                // - If a thread opting out of the same nodes is still on its way up, its decrements and our increments
+                //   add up the same in any order. OptOut already handles a parent that counts one node too many for a
+                //   while (that is what STUCK is for).
+                this->stats.OptIn(tid);
+                uint32_t node = this->Leaf(tid);
+                uint32_t joining[32];
+                uint32_t joining_count = 0;
+                while (true)
+                {
+                    std::atomic<Payload>& node_payload = this->payload_tree[node].payload;
+                    uint32_t old_threads;
+                    while (!this->TryAddThreads(tid, node_payload, 1, old_threads))
+                    {
+                        // The node is in use, wait for it to be released before retrying.
+                        this->WaitUntilFree(tid, node_payload);
+                    }
+                    if (old_threads != 0)
+                    {
+                        break;
+                    }
+                    joining[joining_count++] = node;
+                    if (node == 0)
+                    {
+                        break;
+                    }
+                    // We were at 0, must increment parent
+                    node = this->Parent(node);
+                }
+                // We are counted all the way up now, let everyone else in
+                while (joining_count != 0)
+                {
+                    this->Join(tid, this->payload_tree[joining[--joining_count]].payload);
+                }
+            }
+
+            // Opts in every tid in [first_tid, last_tid), touching every node on their way up once. None of them may
+            // arrive before this returns.
+            void OptInRange(uint32_t first_tid, uint32_t last_tid)
+            {
+                // This goes up like OptIn, but for many threads at once, and that needs more care: once we add
+                // threads to a node that was already counted in its parent, it cannot finish a phase before we return
+                // (the threads we added cannot arrive before then), and neither can the root. If we then waited for
+                // another node to be free, and that node was in the middle of a phase, we would wait forever. So we
+                // never wait while holding such a node: if we run into a node in use, we give back everything we
+                // added to counted nodes, wait for it, and try again. Nodes that were at 0 are not counted anywhere
+                // yet, so we keep those, and they stay JOINING until we are done.
+                if (first_tid >= last_tid)
+                {
+                    return;
+                }
+                this->stats.OptIn(first_tid);
+                std::map<uint32_t, uint32_t> pending = this->LeafCounts(first_tid, last_tid);
+                std::vector<std::pair<uint32_t, uint32_t>> held;
+                std::vector<uint32_t> joining;
+                while (!pending.empty())
+                {
+                    auto it = std::prev(pending.end());
+                    uint32_t node = it->first;
+                    uint32_t count = it->second;
+                    std::atomic<Payload>& node_payload = this->payload_tree[node].payload;
+                    uint32_t old_threads;
+                    if (!this->TryAddThreads(first_tid, node_payload, count, old_threads))
+                    {
+                        while (!held.empty())
+                        {
+                            this->Leave(first_tid, held.back().first, held.back().second);
+                            pending[held.back().first] += held.back().second;
+                            held.pop_back();
+                        }
+                        this->WaitUntilFree(first_tid, node_payload);
+                        continue;
+                    }
+                    pending.erase(it);
+                    if (old_threads != 0)
+                    {
+                        held.emplace_back(node, count);
+                        continue;
+                    }
+                    joining.push_back(node);
+                    if (node != 0)
+                    {
+                        // We were at 0, must increment parent
+                        pending[this->Parent(node)]++;
+                    }
+                }
+                // We are counted all the way up now, let everyone else in
+                for (uint32_t node : joining)
+                {
+                    this->Join(first_tid, this->payload_tree[node].payload);
+                }
+            }
+
+            void OptOut(uint32_t tid)
+            {
+                // To avoid deadlocks, decrementing threads can happen at any time the state is ENTERING, as long as
+                // waiting is less than threads.
+                // To elaborate on deadlocks, imaging the following scenario:
+                // 1. Thread 1 enters.
+                // 2. Thread 2 tries to decrement, has to wait for all to exit barrier.
+                // 3. Thread 1 will never exit barrier because it is waiting for thread 2 to enter.
+                // 4. Deadlock.
+
+                // We do the following:
+                // 1. Find the leaf node we are at.
+                // 2. If the state is EXITING, wait for it to become ENTERING.
+                // 3. If the state is ENTERING, decrement the threads.
+                // 4. If after decrementing, waiting is equal to threads, set state to STUCK.
+                // 5. If after decrementing, number of threads is 0, also decrement the parent node. Repeat if needed
+                this->stats.OptOut(tid);
+                this->Leave(tid, this->Leaf(tid), 1);
+            }
+
+            // Opts out every tid in [first_tid, last_tid), touching every node on their way up once. None of them may
+            // be arriving.
+            void OptOutRange(uint32_t first_tid, uint32_t last_tid)
+            {
+                // Unlike opting in, taking threads out never keeps a node from finishing its phase, so we can go
+                // level by level without ever backing off.
+                if (first_tid >= last_tid)
+                {
+                    return;
+                }
+                this->stats.OptOut(first_tid);
+                std::map<uint32_t, uint32_t> pending = this->LeafCounts(first_tid, last_tid);
+                while (!pending.empty())
+                {
+                    auto it = std::prev(pending.end());
+                    uint32_t node = it->first;
+                    uint32_t left = this->RemoveThreads(first_tid, this->payload_tree[node].payload, it->second);
+                    pending.erase(it);
+                    if (left == 0 && node != 0)
+                    {
+                        pending[this->Parent(node)]++;
+                    }
+                }
+            }
+
+            // Counts as our arrival in this phase, and opts us out, without waiting for anyone (like
+            // std::barrier::arrive_and_drop). Nobody else needs anything from us, so it is the same as leaving before
+            // we arrive, except that the nodes we have not arrived at cannot be in the middle of releasing anyone. Our
+            // leaf takes a single CAS. Only if we were the last thread of a node does its parent take one as well. If
+            // the threads left in a node were all waiting for us, it is left STUCK for one of them to take up the tree.
+            // We contribute nothing to ArriveAndReduce.
+            void ArriveAndOptOut(uint32_t tid)
+            {
+                this->stats.OptOut(tid);
+                this->Leave(tid, this->Leaf(tid), 1, false);
+            }
+
+            void Arrive(uint32_t tid)
+            {
+                NoReduction reduction;
+                this->Arrive(tid, reduction);
+            }
+
+            // The first half of Arrive: counts us as arrived and takes our nodes up the tree as far as we are the last
+            // to get there, but does not wait for the others. The only wait left is for the threads of our nodes that
+            // have not called Wait for the previous phase yet. Every token must be passed to Wait (or to TryWait until
+            // it returns true, or to OptOut) before arriving again. Until then, the threads sharing our leaf cannot
+            // arrive at the next phase either.
+            Token ArriveNoWait(uint32_t tid)
+            {
+                this->stats.Arrived(tid);
+                uint32_t path[32];
+                this->Path(tid, path);
+                NoReduction reduction;
+                return Token(this->Climb(tid, path, this->tree_depth - 1, false, reduction));
+            }
+
+            // The second half of Arrive: waits for everyone else to arrive.
+            void Wait(uint32_t tid, Token token)
+            {
+                if (token.level >= 0)
+                {
+                    uint32_t path[32];
+                    this->Path(tid, path);
+                    NoReduction reduction;
+                    this->Await(tid, path, token.level, true, reduction);
+                }
+                this->stats.Released(tid);
+            }
+
+            // Returns whether everyone else arrived, without waiting. It may still have to take one of our nodes up
+            // the tree (if an OptOut left it STUCK), so it updates the token.
+            bool TryWait(uint32_t tid, Token& token)
+            {
+                if (token.level >= 0)
+                {
+                    uint32_t path[32];
+                    this->Path(tid, path);
+                    NoReduction reduction;
+                    token.level = this->Await(tid, path, token.level, false, reduction);
+                }
+                if (token.level >= 0)
+                {
+                    return false;
+                }
+                this->stats.Released(tid);
+                return true;
+            }
+
+            // Opts out a thread that arrived without waiting yet. Its arrival still counts for this phase, and nobody
+            // has to wait for it after that. If we wait in our leaf, we take ourselves out of both its threads and
+            // waiting, which leaves the leaf just as far from done, wherever our arrival got to. Further up, we took
+            // the nodes below up the tree, so we take our arrival back out of them instead, and leave like
+            // ArriveAndOptOut. Neither waits for the phase to complete. Only if someone already took our arrival
+            // further up than where we wait do we have to, since only we can release the nodes below.
+            void OptOut(uint32_t tid, Token token)
+            {
+                this->stats.OptOut(tid);
+                uint32_t path[32];
+                this->Path(tid, path);
+                NoReduction reduction;
+                const int32_t leaf_level = this->tree_depth - 1;
+                int32_t level = token.level;
+                while (level >= 0)
+                {
+                    // A node that was released is left as usual, and a STUCK one taken up the tree
+                    level = this->Await(tid, path, level, false, reduction);
+                    if (level < 0)
+                    {
+                        break;
+                    }
+                    if (level == leaf_level)
+                    {
+                        if (this->Drop(tid, this->payload_tree[path[level]].payload))
+                        {
+                            return;
+                        }
+                        continue;
+                    }
+                    if (this->Withdraw(tid, path, level))
+                    {
+                        break;
+                    }
+                    std::atomic<Payload>& node_payload = this->payload_tree[path[level]].payload;
+                    Payload temp_payload = node_payload.load();
+                    if (temp_payload.state == State::ENTERING && temp_payload.waiting == temp_payload.threads)
+                    {
+                        this->stats.Spin(tid);
+                        WaitPolicy::Wait(node_payload, temp_payload);
+                    }
+                }
+                // We are out of this phase, or never were in it
+                this->Leave(tid, path[leaf_level], 1, false);
+            }
+
+            // Arrives at the barrier, but only waits until deadline. If the others did not all arrive by then, takes
+            // our arrival back out of every node we got to and returns false, as if we never arrived. We are still
+            // opted in, so we can arrive again or opt out (and so can a watchdog, for the threads that did not show
+            // up). If another thread already took our arrival further up the tree, we cannot take it back until that
+            // thread gives up too, or the phase completes, so everyone should use the same timeout. Waits by polling.
+            template <typename Clock, typename Duration>
+            bool TryArriveUntil(uint32_t tid, const std::chrono::time_point<Clock, Duration>& deadline)
+            {
+                this->stats.Arrived(tid);
+                uint32_t path[32];
+                this->Path(tid, path);
+                NoReduction reduction;
+                int32_t level = this->Climb(tid, path, this->tree_depth - 1, false, reduction);
+                while (true)
+                {
+                    level = this->Await(tid, path, level, false, reduction);
+                    if (level < 0)
+                    {
+                        this->stats.Released(tid);
+                        return true;
+                    }
+                    if (Clock::now() >= deadline && this->Withdraw(tid, path, level))
+                    {
+                        return false;
+                    }
+                    std::atomic<Payload>& node_payload = this->payload_tree[path[level]].payload;
+                    this->stats.Spin(tid);
+                    WaitPolicy::Poll(node_payload, node_payload.load());
+                }
+            }
+
+            template <typename Rep, typename Period>
+            bool TryArriveFor(uint32_t tid, const std::chrono::duration<Rep, Period>& timeout)
+            {
+                return this->TryArriveUntil(tid, std::chrono::steady_clock::now() + timeout);
+            }
+
+            Stats& GetStats()
+            {
+                return this->stats;
+            }
+
+            uint32_t GetMaxThreads() const
+            {
+                return this->max_threads;
+            }
+
+            uint32_t GetOptedInThreads() const
+            {
+                // Total number of threads of every node in the leafs
+                uint32_t total_threads = 0;
+                for (uint32_t i = 0; i < this->leaf_nodes; i++)
+                {
+                    total_threads += this->payload_tree[this->leaf_offset + i].payload.load().threads;
+                }
+                return total_threads;
+            }
+
+            uint32_t GetWaitingThreads() const
+            {
+                // Total number of waiting threads of every node in the leafs
+                uint32_t total_threads = 0;
+                for (uint32_t i = 0; i < this->leaf_nodes; i++)
+                {
+                    total_threads += this->payload_tree[this->leaf_offset + i].payload.load().waiting;
+                }
+                return total_threads;
+            }
+    };
+}
+
+#endif //__DYNBAR_TREEPROTOCOL_HPP__
@@ -0,0 +1,209 @@
+#ifndef __DYNBAR_WAITPOLICY_HPP__
+#define __DYNBAR_WAITPOLICY_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <sched.h>
+#ifdef __linux__
+#include <climits>
+#include <cstddef>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+namespace DYNBAR
+{
+    // Tells the core we are in a spin loop, so it can save power and let an SMT sibling run.
+    inline void Pause()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
+    // A wait policy decides what a thread does while it waits for a payload to change. Barriers call Wait() in a
+    // loop with the last payload they observed, re-checking their condition after every return, and call Notify()
+    // after every change that a waiter could be waiting for. Policies are picked at compile time, so the ones that
+    // do not need to be notified cost nothing on the fast path.
+    // Waiters that have a deadline call Poll() instead, which waits a little, but always comes back so they can check
+    // the time. There is no timed std::atomic::wait, so the parking policies yield instead of parking there.
+
+    // Busy waits on the payload. This is the fastest to react, but keeps every waiting core at 100%.
+    struct SpinWait
+    {
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+        }
+    };
+
+    // Busy waits on the payload, but pauses between every two checks. Slightly slower to react than SpinWait, but
+    // gentler on the SMT sibling and on the memory system.
+    struct PauseWait
+    {
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+            Pause();
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+            Pause();
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+        }
+    };
+
+    // Gives up the rest of the time slice between every two checks. Useful when there are more threads than cores.
+    struct YieldWait
+    {
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+            sched_yield();
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+            sched_yield();
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+        }
+    };
+
+    // Parks the waiting thread in the kernel until the payload changes and the thread that changed it wakes it up.
+    // Waking up is slower than spinning, but waiting threads do not burn any CPU.
+    struct ParkWait
+    {
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+            payload.wait(old_payload);
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+            sched_yield();
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+            payload.notify_all();
+        }
+    };
+
+#ifdef __linux__
+    // Parks like ParkWait, but on a futex that is not private to the process, so it also works for barriers in memory
+    // shared between processes (see Shared.hpp). std::atomic::wait cannot do that, it parks smaller payloads on a
+    // table of its own. A futex is always a 4 byte word, so we park on the aligned word the payload is in, and a
+    // change to any of it wakes us. The tree barriers pack up to 4 nodes in a word, so a thread may be woken up by a
+    // neighbouring node every now and then, and go back to sleep. Payloads wider than 4 bytes would need a change to
+    // the other half to wake us too, which a futex cannot do, so those have to spin.
+    struct SharedParkWait
+    {
+        template <typename T>
+        static const uint32_t* Word(const std::atomic<T>& payload)
+        {
+            static_assert(sizeof(std::atomic<T>) <= 4 && 4 % alignof(std::atomic<T>) == 0,
+                          "Only payloads of up to 4 bytes can park on a futex");
+            return reinterpret_cast<const uint32_t*>(reinterpret_cast<uintptr_t>(&payload) & ~uintptr_t(3));
+        }
+
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+            // Read the word first, then make sure the payload in it did not change yet. If it changes after that, the
+            // word does too, and the kernel will not let us sleep on the old value.
+            const uint32_t* word = Word(payload);
+            uint32_t old_word = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            T new_payload = payload.load();
+            if (std::memcmp(&new_payload, &old_payload, sizeof(T)) != 0)
+            {
+                return;
+            }
+            syscall(SYS_futex, word, FUTEX_WAIT, old_word, nullptr, nullptr, 0);
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+            sched_yield();
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+            syscall(SYS_futex, Word(payload), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    };
+#endif // __linux__
+
+    // Spins (with pauses) for a while, then parks if the payload still did not change. Short waits get the latency
+    // of spinning, long waits stop burning CPU.
+    template <uint32_t Spins = 1024>
+    struct HybridWait
+    {
+        template <typename T>
+        static void Wait(const std::atomic<T>& payload, T old_payload)
+        {
+            for (uint32_t i = 0; i < Spins; i++)
+            {
+                T new_payload = payload.load();
+                if (std::memcmp(&new_payload, &old_payload, sizeof(T)) != 0)
+                {
+                    return;
+                }
+                Pause();
+            }
+            payload.wait(old_payload);
+        }
+
+        template <typename T>
+        static void Poll(const std::atomic<T>& payload, T old_payload)
+        {
+            for (uint32_t i = 0; i < Spins; i++)
+            {
+                T new_payload = payload.load();
+                if (std::memcmp(&new_payload, &old_payload, sizeof(T)) != 0)
+                {
+                    return;
+                }
+                Pause();
+            }
+            sched_yield();
+        }
+
+        template <typename T>
+        static void Notify(std::atomic<T>& payload)
+        {
+            payload.notify_all();
+        }
+    };
+}
+
+#endif //__DYNBAR_WAITPOLICY_HPP__
@@ -0,0 +1,134 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+#include "DynBar/AdaptiveDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define FREQUENCY 10            // How often should we decrement from the barrier
+#define LENGTH 5                // How long should a thread spend unbarriered
+
+// Switches engines after every single phase, which is as hard as it gets for everyone to follow along
+struct EveryPhase
+{
+    bool UseTree(bool tree, uint32_t threads) const
+    {
+        return !tree;
+    }
+};
+
+std::atomic<uint64_t> phases(0);
+std::atomic<uint32_t> errors(0);
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+// The first half of the threads never leave, so every phase needs them, and each of their arrivals must complete
+// exactly one phase, whichever engine it ran on. The second half keep leaving and coming back.
+uint32_t steady_threads;
+
+DYNBAR::AdaptiveDynamicBarrier<2, DYNBAR::SpinWait, EveryPhase, CountPhase>* barrier;
+
+void steady_thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        barrier->Arrive(tid);
+        if (phases.load() != i + 1)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + " phase " +
+              std::to_string(phases.load()) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut(tid);
+}
+
+void churning_thread(uint32_t tid)
+{
+    srand(time(nullptr) + tid);
+    bool use_barrier = false;
+    uint32_t length = LENGTH;
+    // Stop once the steady threads are about to, so nobody is left waiting for a phase that never comes
+    while (phases.load() + LENGTH < iterations)
+    {
+        if (use_barrier)
+        {
+            if ((rand() % FREQUENCY) == 0)
+            {
+                barrier->OptOut(tid);
+                use_barrier = false;
+                length = LENGTH;
+            }
+            else
+            {
+                barrier->Arrive(tid);
+            }
+        }
+        else
+        {
+            length--;
+            if (length == 0)
+            {
+                barrier->OptIn(tid);
+                use_barrier = true;
+            }
+            std::this_thread::yield();
+        }
+    }
+    if (use_barrier)
+    {
+        barrier->OptOut(tid);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    steady_threads = thread_count - thread_count / 2;
+
+    barrier = new DYNBAR::AdaptiveDynamicBarrier<2, DYNBAR::SpinWait, EveryPhase, CountPhase>(thread_count,
+                                                                                               steady_threads);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        if (i < steady_threads)
+        {
+            threads.emplace_back(std::thread(steady_thread, i));
+        }
+        else
+        {
+            threads.emplace_back(std::thread(churning_thread, i));
+        }
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    if (errors.load() != 0 || phases.load() != iterations || barrier->GetSwitches() != iterations)
+    {
+        std::cerr << errors.load() << " arrivals did not complete exactly one phase, " << phases.load()
+                  << " phases and " << barrier->GetSwitches() << " switches for " << iterations << " iterations\n";
+        return 1;
+    }
+    delete barrier;
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <random>
+#include <iostream>
+
+#include "DynBar/AsyncDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define COROUTINES 64           // How many coroutines every executor thread runs
+#define FREQUENCY 10            // How often should we decrement from the barrier
+#define LENGTH 5                // How long should a coroutine spend unbarriered
+
+// A few executor threads run many more coroutines than that, so nobody may ever wait for the barrier on a thread.
+// The first half of the coroutines never leave, so every phase needs them, and each of their arrivals must complete
+// exactly one phase. The second half keep leaving and coming back.
+std::atomic<uint64_t> phases(0);
+std::atomic<uint32_t> errors(0);
+std::atomic<uint32_t> running(0);
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+// Runs whatever it is handed on the executor threads, until every coroutine is done
+std::mutex queue_mutex;
+std::condition_variable queue_ready;
+std::deque<std::coroutine_handle<>> queue;
+
+struct Executor
+{
+    void operator()(std::coroutine_handle<> handle) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back(handle);
+        }
+        queue_ready.notify_one();
+    }
+};
+
+void executor()
+{
+    while (true)
+    {
+        std::coroutine_handle<> handle;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_ready.wait(lock, []{ return !queue.empty() || running.load() == 0; });
+            if (queue.empty())
+            {
+                return;
+            }
+            handle = queue.front();
+            queue.pop_front();
+        }
+        handle.resume();
+    }
+}
+
+// Gets back in line on the executor, so others get to run
+struct Yield
+{
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) const
+    {
+        Executor()(handle);
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+};
+
+// A coroutine that starts on the executor, and tells everyone once it is done
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object()
+        {
+            return Task();
+        }
+
+        Yield initial_suspend() noexcept
+        {
+            return Yield();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            if (--running == 0)
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue_ready.notify_all();
+            }
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+DYNBAR::AsyncDynamicBarrier<uint32_t, Executor, CountPhase>* barrier;
+
+Task steady_coroutine(uint32_t id)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        co_await barrier->ArriveAsync();
+        if (phases.load() != i + 1)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Coroutine " + std::to_string(id) + " iteration " + std::to_string(i) + " phase " +
+              std::to_string(phases.load()) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut();
+}
+
+Task churning_coroutine(uint32_t id)
+{
+    // Every coroutine rolls its own numbers, rand() is shared by every executor thread (and not thread safe)
+    std::mt19937 rng(id);
+    bool use_barrier = false;
+    uint32_t length = LENGTH;
+    // Stop once the steady coroutines are about to, so nobody is left waiting for a phase that never comes
+    while (phases.load() + LENGTH < iterations)
+    {
+        if (use_barrier)
+        {
+            if ((rng() % FREQUENCY) == 0)
+            {
+                barrier->OptOut();
+                use_barrier = false;
+                length = LENGTH;
+            }
+            else
+            {
+                co_await barrier->ArriveAsync();
+            }
+        }
+        else
+        {
+            length--;
+            if (length == 0)
+            {
+                barrier->OptIn();
+                use_barrier = true;
+            }
+            co_await Yield();
+        }
+    }
+    if (use_barrier)
+    {
+        barrier->OptOut();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    uint32_t coroutine_count = thread_count * COROUTINES;
+    uint32_t steady_coroutines = coroutine_count - coroutine_count / 2;
+
+    barrier = new DYNBAR::AsyncDynamicBarrier<uint32_t, Executor, CountPhase>(coroutine_count, steady_coroutines);
+    running = coroutine_count;
+    for (uint32_t i = 0; i < coroutine_count; i++)
+    {
+        if (i < steady_coroutines)
+        {
+            steady_coroutine(i);
+        }
+        else
+        {
+            churning_coroutine(i);
+        }
+    }
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(executor));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    if (errors.load() != 0 || phases.load() != iterations || barrier->GetOptedInThreads() != 0)
+    {
+        std::cerr << errors.load() << " arrivals did not complete exactly one phase, " << phases.load()
+                  << " phases for " << iterations << " iterations, " << barrier->GetOptedInThreads()
+                  << " coroutines left opted in\n";
+        return 1;
+    }
+    delete barrier;
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <barrier>
+#include <algorithm>
+#include <iostream>
+
+#include "DynBar/DisseminationDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// Everyone but the last thread is opted in, and thread 0 only arrives once the last thread is back from OptIn. If
+// OptIn waited for the phase boundary, which needs thread 0, the test hangs. Then the last thread arrives once and opts
+// out, which takes part in one more phase, so the members go through three phases every round. The first arrival of
+// the last thread must be in the phase after the one in progress when it opted in, so by the time it is back, every
+// member must be done with that one. A std::barrier lines everyone up between rounds.
+std::atomic<bool> joined;
+std::atomic<uint32_t> first_phase_done;
+std::atomic<uint32_t> errors(0);
+
+DYNBAR::DisseminationDynamicBarrier<>* barrier;
+std::barrier<>* rounds;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    const uint32_t joiner = thread_count - 1;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        rounds->arrive_and_wait();
+        if (tid == joiner)
+        {
+            barrier->OptIn(tid);
+            joined.store(true);
+            barrier->Arrive(tid);
+            if (first_phase_done.load() != joiner)
+            {
+                errors++;
+            }
+            barrier->OptOut(tid);
+        }
+        else
+        {
+            if (tid == 0)
+            {
+                while (!joined.load())
+                {
+                    std::this_thread::yield();
+                }
+            }
+            barrier->Arrive(tid);
+            first_phase_done++;
+            barrier->Arrive(tid);
+            barrier->Arrive(tid);
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+        rounds->arrive_and_wait();
+        if (tid == 0)
+        {
+            joined.store(false);
+            first_phase_done.store(0);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::max(std::stoi(argv[1]), 3);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::DisseminationDynamicBarrier<>(thread_count, thread_count - 1);
+    rounds = new std::barrier<>(thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete rounds;
+    delete barrier;
+    if (errors.load() != 0)
+    {
+        std::cout << errors.load() << " first arrivals did not wait for the phase in progress\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// Thread tid arrives iterations + tid times, and its last arrival also opts it out, so the last phases are completed
+// by threads that leave without waiting. The completion function counts the phases, so after its i-th arrival every
+// thread that waited must see exactly i + 1 phases. The very last arrival leaves nobody behind, so it completes none.
+uint32_t phases;
+std::atomic<uint32_t> errors;
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::SpinWait, CountPhase>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations + tid - 1; i++)
+    {
+        barrier->Arrive();
+        if (phases != i + 1)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->ArriveAndOptOut();
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::SpinWait, CountPhase>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0 || phases != iterations + thread_count - 2)
+    {
+        std::cout << "Completion ran " << phases << " times, " << errors.load() << " threads saw the wrong count\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+#include "DynBar/FlatMultiWideDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define BARRIERS 1000           // More than the 127 a FlatMultiDynamicBarrier can rotate through
+#define FREQUENCY 10            // How often should we decrement from the barrier
+#define LENGTH 2                // How long should a thread spend unbarriered
+
+// Every iteration goes around all of the barriers, so every iteration is BARRIERS phases. Threads only opt in or out
+// between iterations, while the barrier is back at index 0. Yielding keeps that many phases quick even if there are
+// more threads than cores.
+std::atomic<uint64_t> phases(0);
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::FlatMultiWideDynamicBarrier<20, 12, DYNBAR::YieldWait, CountPhase>* barrier;
+
+void thread(uint32_t tid)
+{
+    srand(time(nullptr) + tid);
+    bool use_barrier = true;
+    uint32_t length = 0;
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        if (use_barrier)
+        {
+            if ((rand() % FREQUENCY) == 0)
+            {
+                barrier->OptOut();
+                use_barrier = false;
+                length = LENGTH;
+            }
+            else
+            {
+                for (uint32_t index = 0; index < BARRIERS; index++)
+                {
+                    barrier->Arrive(index);
+                }
+#ifndef NDEBUG
+                str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + " went around\n";
+                std::cout << str;
+#endif // NDEBUG
+            }
+        }
+        else
+        {
+            length--;
+            if (length == 0)
+            {
+                barrier->OptIn();
+                use_barrier = true;
+            }
+        }
+    }
+    if (use_barrier)
+    {
+        barrier->OptOut();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::FlatMultiWideDynamicBarrier<20, 12, DYNBAR::YieldWait, CountPhase>(BARRIERS, thread_count,
+                                                                                              thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    // Nobody can leave in the middle of a round, so every round that started went all the way around
+    if (phases.load() % BARRIERS != 0 || barrier->GetOptedInThreads() != 0 || barrier->GetWaitingThreads() != 0)
+    {
+        std::cerr << "Stopped after " << phases.load() << " phases, with " << barrier->GetOptedInThreads()
+                  << " threads opted in and " << barrier->GetWaitingThreads() << " waiting\n";
+        return 1;
+    }
+    delete barrier;
+    return 0;
+}
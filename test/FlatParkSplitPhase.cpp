@@ -0,0 +1,120 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <barrier>
+#include <algorithm>
+#include <iostream>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// Thread 0 arrives without waiting, so it is the only one waiting in the barrier, and every thread but 0 and 1 tries
+// to opt in meanwhile, which parks them until the barrier is empty again. Thread 0 then opts out with its token, which
+// empties the barrier. Nobody arrives before everyone got in, so if nobody wakes them up, the test hangs. Otherwise,
+// thread 1 and everyone who got in complete a phase. A std::barrier lines everyone up between rounds.
+std::atomic<uint32_t> phases;
+std::atomic<bool> arrived;
+std::atomic<uint32_t> joining;
+std::atomic<uint32_t> joined;
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::ParkWait, CountPhase>* barrier;
+std::barrier<>* rounds;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        rounds->arrive_and_wait();
+        if (tid == 0)
+        {
+            auto token = barrier->ArriveNoWait();
+            arrived.store(true);
+            while (joining.load() != thread_count - 2)
+            {
+                std::this_thread::yield();
+            }
+            // Give them a chance to park
+            for (uint32_t j = 0; j < 10; j++)
+            {
+                std::this_thread::yield();
+            }
+            barrier->OptOut(token);
+        }
+        else
+        {
+            if (tid != 1)
+            {
+                while (!arrived.load())
+                {
+                    std::this_thread::yield();
+                }
+                joining++;
+                barrier->OptIn();
+                joined++;
+            }
+            // Nobody can get in while someone is waiting, so nobody arrives before everyone is in
+            while (joined.load() != thread_count - 2)
+            {
+                std::this_thread::yield();
+            }
+            barrier->Arrive();
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+        rounds->arrive_and_wait();
+        // Back to thread 0 and 1 opted in
+        if (tid == 0)
+        {
+            arrived.store(false);
+            joining.store(0);
+            joined.store(0);
+            barrier->OptIn();
+        }
+        else if (tid != 1)
+        {
+            barrier->OptOut();
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::max(std::stoi(argv[1]), 3);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::ParkWait, CountPhase>(thread_count, 2);
+    rounds = new std::barrier<>(thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete rounds;
+    delete barrier;
+    if (phases.load() != iterations)
+    {
+        std::cout << phases.load() << " phases for " << iterations << " iterations\n";
+        return 1;
+    }
+    return 0;
+}
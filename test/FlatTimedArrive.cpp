@@ -0,0 +1,90 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// The last thread hangs halfway through. Everyone else arrives with a timeout, and the first one to give up after it
+// hung drops it from the barrier, so the rest keep going. The completion function counts the phases, so after its i-th
+// arrival every thread must see exactly i + 1 phases, no matter how many times it had to try.
+uint32_t phases;
+std::atomic<bool> hanging;
+std::atomic<bool> dropped;
+std::atomic<uint32_t> errors;
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::SpinWait, CountPhase>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    uint32_t hung = thread_count - 1;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        if (tid == hung && tid != 0 && i == iterations / 2)
+        {
+            hanging = true;
+            while (!dropped.load())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return;
+        }
+        while (!barrier->TryArriveFor(std::chrono::milliseconds(5)))
+        {
+            bool expected = false;
+            if (hanging.load() && dropped.compare_exchange_strong(expected, true))
+            {
+                barrier->OptOut();
+            }
+        }
+        if (phases != i + 1)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut();
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::FlatDynamicBarrier<uint32_t, DYNBAR::SpinWait, CountPhase>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0 || phases != iterations)
+    {
+        std::cout << "Completion ran " << phases << " times, " << errors.load() << " threads saw the wrong count\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <string>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "DynBar/FlatDynamicBarrier.hpp"
+#include "DynBar/Shared.hpp"
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t process_count;
+uint32_t iterations;
+
+// Every process maps the same memfd twice: once before forking, and once more on its own, at an address of its own
+// choosing. The barriers are only ever used through the second mapping, so they have to work wherever they are mapped.
+// Process 0 never leaves, and everyone else leaves a bit earlier than the last. Every arrival bumps a counter first,
+// so once a process gets through a barrier, everyone still opted in must have bumped it for that phase.
+struct Counters
+{
+    std::atomic<uint32_t> flat_arrivals;
+    std::atomic<uint32_t> tree_arrivals;
+    std::atomic<uint32_t> flat_phases;
+    std::atomic<uint32_t> tree_phases;
+    std::atomic<uint32_t> errors;
+};
+
+// Completion functions run in whichever process completes the phase, so they find the counters through a global of
+// that process, never through a pointer in the shared memory
+Counters* counters;
+
+struct CountFlat
+{
+    void operator()() const noexcept
+    {
+        counters->flat_phases++;
+    }
+};
+
+struct CountTree
+{
+    void operator()() const noexcept
+    {
+        counters->tree_phases++;
+    }
+};
+
+typedef DYNBAR::FlatDynamicBarrier<uint16_t, DYNBAR::SharedParkWait, CountFlat> Flat;
+typedef DYNBAR::TreeDynamicBarrier<2, DYNBAR::SharedParkWait, 1, CountTree> Tree;
+
+std::size_t flat_offset;
+std::size_t tree_offset;
+std::size_t size;
+
+uint32_t Iterations(uint32_t pid)
+{
+    return iterations - (pid * iterations) / (2 * process_count);
+}
+
+// How many arrivals there must have been by the time anyone gets through phase i
+uint32_t Expected(uint32_t i)
+{
+    uint32_t expected = 0;
+    for (uint32_t pid = 0; pid < process_count; pid++)
+    {
+        expected += std::min(i + 1, Iterations(pid));
+    }
+    return expected;
+}
+
+int process(int fd, uint32_t pid)
+{
+    char* memory = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (memory == MAP_FAILED)
+    {
+        return 1;
+    }
+    counters = reinterpret_cast<Counters*>(memory);
+    Flat* flat = DYNBAR::AttachShared<Flat>(memory + flat_offset);
+    Tree* tree = DYNBAR::AttachShared<Tree>(memory + tree_offset);
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < Iterations(pid); i++)
+    {
+        counters->flat_arrivals++;
+        flat->Arrive();
+        if (counters->flat_arrivals.load() < Expected(i))
+        {
+            counters->errors++;
+        }
+        counters->tree_arrivals++;
+        tree->Arrive(pid);
+        if (counters->tree_arrivals.load() < Expected(i))
+        {
+            counters->errors++;
+        }
+#ifndef NDEBUG
+        str = "Process " + std::to_string(pid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    flat->OptOut();
+    tree->OptOut(pid);
+    std::cout.flush();
+    munmap(memory, size);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    process_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    flat_offset = 64;
+    tree_offset = flat_offset + (DYNBAR::SharedSize<Flat>(process_count, process_count) + 63) / 64 * 64;
+    size = tree_offset + DYNBAR::SharedSize<Tree>(process_count, process_count);
+    int fd = memfd_create("SharedBarrier", 0);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        std::cerr << "Could not create the shared memory\n";
+        return 1;
+    }
+    char* memory = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Could not map the shared memory\n";
+        return 1;
+    }
+    counters = new (memory) Counters();
+    DYNBAR::CreateShared<Flat>(memory + flat_offset, process_count, process_count);
+    DYNBAR::CreateShared<Tree>(memory + tree_offset, process_count, process_count);
+    std::cout.flush();
+    std::vector<pid_t> children;
+    for (uint32_t i = 0; i < process_count; i++)
+    {
+        pid_t child = fork();
+        if (child == 0)
+        {
+            _exit(process(fd, i));
+        }
+        children.push_back(child);
+    }
+    uint32_t failed = 0;
+    for (pid_t child : children)
+    {
+        int status;
+        if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failed++;
+        }
+    }
+    if (failed != 0 || counters->errors.load() != 0 || counters->flat_phases.load() != iterations ||
+        counters->tree_phases.load() != iterations)
+    {
+        std::cerr << failed << " processes failed, " << counters->errors.load() << " arrivals got through early, "
+                  << counters->flat_phases.load() << " flat and " << counters->tree_phases.load() << " tree phases for "
+                  << iterations << " iterations\n";
+        return 1;
+    }
+    DYNBAR::DestroyShared<Tree>(memory + tree_offset);
+    DYNBAR::DestroyShared<Flat>(memory + flat_offset);
+    munmap(memory, size);
+    close(fd);
+    return 0;
+}
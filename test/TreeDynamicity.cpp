@@ -16,7 +16,7 @@ uint32_t iterations;
 #define LENGTH 5                // How long should a thread spen unbarriered
 
 
-DYNBAR::TreeDynamicBarrier* barrier;
+DYNBAR::TreeDynamicBarrier<2>* barrier;
 
 void thread(uint32_t tid)
 {
@@ -75,7 +75,7 @@ int main(int argc, char** argv)
     thread_count = std::stoi(argv[1]);
     iterations = std::stoi(argv[2]);
 
-    barrier = new DYNBAR::TreeDynamicBarrier(2, thread_count);
+    barrier = new DYNBAR::TreeDynamicBarrier<2>(thread_count);
     std::vector<std::thread> threads;
     for (uint32_t i = 0; i < thread_count; i++)
     {
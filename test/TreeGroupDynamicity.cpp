@@ -0,0 +1,101 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#ifndef NDEBUG
+#include <iostream>
+#endif // NDEBUG
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define ROUNDS 10               // How many times should the group be opted in and out
+#define LENGTH 5                // How many times should the group arrive every round
+
+// The first half of the threads arrive iterations times. The second half is a group that the main thread opts in and
+// out all at once, every round arriving LENGTH times in between.
+uint32_t group_first;
+std::atomic<uint32_t> group_round;
+std::atomic<uint32_t> done;
+
+DYNBAR::TreeDynamicBarrier<2>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        barrier->Arrive(tid);
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut(tid);
+}
+
+void group_thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t r = 1; r <= ROUNDS; r++)
+    {
+        // Wait for the main thread to opt us in
+        while (group_round.load() < r)
+        {
+            std::this_thread::yield();
+        }
+        for (uint32_t i = 0; i < LENGTH; i++)
+        {
+            barrier->Arrive(tid);
+#ifndef NDEBUG
+            str = "Group thread " + std::to_string(tid) + " round " + std::to_string(r) + " iteration " +
+                  std::to_string(i) + "\n";
+            std::cout << str;
+#endif // NDEBUG
+        }
+        done++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    group_first = thread_count / 2;
+
+    barrier = new DYNBAR::TreeDynamicBarrier<2>(thread_count, group_first);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        if (i < group_first)
+        {
+            threads.emplace_back(std::thread(thread, i));
+        }
+        else
+        {
+            threads.emplace_back(std::thread(group_thread, i));
+        }
+    }
+    for (uint32_t r = 1; r <= ROUNDS; r++)
+    {
+        barrier->OptInRange(group_first, thread_count);
+        group_round.store(r);
+        while (done.load() < r * (thread_count - group_first))
+        {
+            std::this_thread::yield();
+        }
+        barrier->OptOutRange(group_first, thread_count);
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    return 0;
+}
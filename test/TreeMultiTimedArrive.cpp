@@ -0,0 +1,95 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+#include "DynBar/TreeMultiDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// The last thread hangs halfway through, between two rounds. Everyone else arrives at both barriers with a timeout,
+// and the first one to give up after it hung drops it from the barrier, so the rest keep going. The completion function
+// counts the phases, so after its arrival at barrier index in round i every thread must see exactly 2 * i + index + 1
+// phases, no matter how many times it had to try.
+uint32_t phases;
+std::atomic<bool> hanging;
+std::atomic<bool> dropped;
+std::atomic<uint32_t> errors;
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::TreeMultiDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    uint32_t hung = thread_count - 1;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        if (tid == hung && tid != 0 && i == iterations / 2)
+        {
+            hanging = true;
+            while (!dropped.load())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return;
+        }
+        for (uint8_t index = 0; index < 2; index++)
+        {
+            while (!barrier->TryArriveFor(tid, index, std::chrono::milliseconds(5)))
+            {
+                bool expected = false;
+                if (hanging.load() && dropped.compare_exchange_strong(expected, true))
+                {
+                    barrier->OptOut(hung);
+                }
+            }
+            if (phases != 2 * i + index + 1)
+            {
+                errors++;
+            }
+#ifndef NDEBUG
+            str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + " barrier " +
+                  std::to_string(index + 1) + "\n";
+            std::cout << str;
+#endif // NDEBUG
+        }
+    }
+    barrier->OptOut(tid);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::TreeMultiDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase>(2, thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0 || phases != 2 * iterations)
+    {
+        std::cout << "Completion ran " << phases << " times, " << errors.load() << " threads saw the wrong count\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+// Every thread adds tid + 1 to every phase. Thread tid arrives iterations + tid times, so the threads keep opting out
+// and the sum every thread gets back must only count the ones still in.
+std::atomic<uint32_t> errors;
+
+DYNBAR::TreeDynamicBarrier<2>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations + tid; i++)
+    {
+        uint64_t sum = barrier->ArriveAndReduce(tid, uint64_t(tid + 1));
+        // Threads i - iterations + 1 and up are still in
+        uint64_t first = i < iterations ? 0 : i - iterations + 1;
+        if (sum != (thread_count * (thread_count + 1) - first * (first + 1)) / 2)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + " sum " + std::to_string(sum) +
+              "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut(tid);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::TreeDynamicBarrier<2>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0)
+    {
+        std::cout << errors.load() << " sums were wrong\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <iostream>
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define FREQUENCY 16            // How often should a thread give up its tid and register again
+
+// Nobody picks tids here, the barrier hands them out. Every thread starts with a participant registered up front, so
+// nobody arrives alone. Thread 0 never lets go of its one, and counts its arrivals. Everyone else keeps dropping theirs
+// (which opts them out) and registering again, and can get any free tid back. No two threads may ever hold the same
+// tid, and thread 0 can get at most one phase ahead of a thread that is opted in.
+std::atomic<uint32_t> phases;
+std::atomic<uint32_t> errors;
+std::unique_ptr<std::atomic<bool>[]> owned;
+
+typedef DYNBAR::TreeDynamicBarrier<2, DYNBAR::YieldWait> Barrier;
+Barrier* barrier;
+
+void Own(const Barrier::Participant& participant)
+{
+    if (owned[participant.GetTid()].exchange(true))
+    {
+        errors++;
+    }
+}
+
+void Disown(const Barrier::Participant& participant)
+{
+    owned[participant.GetTid()].store(false);
+}
+
+void thread(uint32_t id, Barrier::Participant participant)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t before = phases.load();
+        participant.Arrive();
+        if (id == 0)
+        {
+            phases++;
+        }
+        else if (phases.load() > before + 2)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(id) + " as tid " + std::to_string(participant.GetTid()) + " iteration " +
+              std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+        if (id != 0 && (i * 7 + id) % FREQUENCY == 0)
+        {
+            Disown(participant);
+            participant = Barrier::Participant();
+            std::this_thread::yield();
+            participant = barrier->Register();
+            Own(participant);
+        }
+    }
+    Disown(participant);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    owned = std::make_unique<std::atomic<bool>[]>(thread_count);
+    barrier = new Barrier(thread_count);
+    std::vector<Barrier::Participant> participants;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        participants.push_back(barrier->Register());
+        Own(participants.back());
+    }
+    // Every tid is taken now
+    try
+    {
+        barrier->Register();
+        errors++;
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i, std::move(participants[i])));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    if (errors.load() != 0 || barrier->GetOptedInThreads() != 0)
+    {
+        std::cout << errors.load() << " errors, " << barrier->GetOptedInThreads() << " threads left opted in\n";
+        return 1;
+    }
+    delete barrier;
+    return 0;
+}
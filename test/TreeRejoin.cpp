@@ -0,0 +1,75 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define FREQUENCY 16            // How often should a thread opt out and back in
+
+// Thread 0 never leaves, and counts its arrivals. Everyone else keeps opting out and back in, often next to a thread
+// that is still on its way in. Once a thread is opted in, the barrier cannot go on without it, so thread 0 can get at
+// most one phase ahead of it while it arrives.
+std::atomic<uint32_t> phases;
+std::atomic<uint32_t> errors;
+
+DYNBAR::TreeDynamicBarrier<2, DYNBAR::YieldWait>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t before = phases.load();
+        barrier->Arrive(tid);
+        if (tid == 0)
+        {
+            phases++;
+        }
+        else if (phases.load() > before + 2)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+        if (tid != 0 && (i * 7 + tid) % FREQUENCY == 0)
+        {
+            barrier->OptOut(tid);
+            std::this_thread::yield();
+            barrier->OptIn(tid);
+        }
+    }
+    barrier->OptOut(tid);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::TreeDynamicBarrier<2, DYNBAR::YieldWait>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0)
+    {
+        std::cout << errors.load() << " arrivals were left behind\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define FREQUENCY 16            // How often should a thread opt out while it still holds a token
+
+// Every thread arrives without waiting, does some work of its own, and only then waits, half of the time by polling
+// TryWait. The completion function counts the phases, and since the next phase cannot complete without us, the count
+// must have gone up by exactly one by the time we are done waiting. Now and then a thread opts out instead of
+// waiting, and comes back in.
+std::atomic<uint32_t> phases;
+std::atomic<uint32_t> errors;
+
+struct CountPhase
+{
+    void operator()() const noexcept
+    {
+        phases++;
+    }
+};
+
+DYNBAR::TreeDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t before = phases.load();
+        auto token = barrier->ArriveNoWait(tid);
+        // Independent work
+        uint32_t work = 0;
+        for (uint32_t j = 0; j < 100; j++)
+        {
+            work += j * tid;
+        }
+        if (tid != 0 && (i * 7 + tid) % FREQUENCY == 0)
+        {
+            barrier->OptOut(tid, token);
+            barrier->OptIn(tid);
+            continue;
+        }
+        if (i % 2 == 0)
+        {
+            barrier->Wait(tid, token);
+        }
+        else
+        {
+            while (!barrier->TryWait(tid, token))
+            {
+                std::this_thread::yield();
+            }
+        }
+        if (phases.load() != before + 1)
+        {
+            errors++;
+        }
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + " work " + std::to_string(work) +
+              "\n";
+        std::cout << str;
+#endif // NDEBUG
+    }
+    barrier->OptOut(tid);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+
+    barrier = new DYNBAR::TreeDynamicBarrier<2, DYNBAR::SpinWait, 1, CountPhase>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    delete barrier;
+    if (errors.load() != 0)
+    {
+        std::cout << errors.load() << " waits returned at the wrong phase\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <thread>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+#include "DynBar/TreeDynamicBarrier.hpp"
+
+uint32_t thread_count;
+uint32_t iterations;
+
+#define FREQUENCY 16            // How often should a thread opt out and back in
+
+// Every thread arrives iterations times, and now and then opts out and back in. The stats must have seen every one of
+// these, under the tid that did it.
+std::atomic<uint32_t> rejoins[64];
+
+DYNBAR::TreeDynamicBarrier<2, DYNBAR::SpinWait, 1, DYNBAR::NoCompletion, DYNBAR::BarrierStats>* barrier;
+
+void thread(uint32_t tid)
+{
+#ifndef NDEBUG
+    std::string str;
+#endif // NDEBUG
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        barrier->Arrive(tid);
+#ifndef NDEBUG
+        str = "Thread " + std::to_string(tid) + " iteration " + std::to_string(i) + "\n";
+        std::cout << str;
+#endif // NDEBUG
+        if (tid != 0 && (i * 7 + tid) % FREQUENCY == 0)
+        {
+            barrier->OptOut(tid);
+            barrier->OptIn(tid);
+            rejoins[tid]++;
+        }
+    }
+    barrier->OptOut(tid);
+}
+
+int main(int argc, char** argv)
+{
+    thread_count = std::stoi(argv[1]);
+    iterations = std::stoi(argv[2]);
+    if (thread_count > 64)
+    {
+        std::cout << "At most 64 threads\n";
+        return 1;
+    }
+
+    barrier = new DYNBAR::TreeDynamicBarrier<2, DYNBAR::SpinWait, 1, DYNBAR::NoCompletion,
+                                             DYNBAR::BarrierStats>(thread_count, thread_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(std::thread(thread, i));
+    }
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads[i].join();
+    }
+    uint32_t errors = 0;
+    for (uint32_t tid = 0; tid < thread_count; tid++)
+    {
+        DYNBAR::BarrierStats::Counters counters = barrier->GetStats().Get(tid);
+        uint64_t waits = 0;
+        for (uint32_t i = 0; i < DYNBAR::BarrierStats::HISTOGRAM_BUCKETS; i++)
+        {
+            waits += counters.waits[i];
+        }
+        // The constructor opts everyone in as tid 0
+        uint64_t opt_ins = rejoins[tid].load() + (tid == 0 ? 1 : 0);
+        if (waits != iterations || counters.opt_ins != opt_ins || counters.opt_outs != rejoins[tid].load() + 1)
+        {
+            std::cout << "Thread " << tid << " waited " << waits << " times, opted in " << counters.opt_ins
+                      << " times and out " << counters.opt_outs << " times\n";
+            errors++;
+        }
+    }
+    if (barrier->GetStats().GetLastArriver() >= thread_count)
+    {
+        std::cout << "Thread " << barrier->GetStats().GetLastArriver() << " arrived last\n";
+        errors++;
+    }
+    delete barrier;
+    return errors != 0;
+}